@@ -0,0 +1,342 @@
+#include "baseline.hpp"
+
+// callee-saved rbx holds the state, rbp the frame with rbx and rsi saved below it and the vregs below those
+constexpr int64_t vreg_offset = -0x110;
+
+// caller-saved and never an argument register while live, rcx is only loaded right before a call
+constexpr ZydisRegister scratch_registers[] =
+{
+	ZYDIS_REGISTER_RAX, ZYDIS_REGISTER_RDX, ZYDIS_REGISTER_R8, ZYDIS_REGISTER_R9, ZYDIS_REGISTER_R10, ZYDIS_REGISTER_R11
+};
+
+static ZydisRegister sized(ZydisRegister reg, int width)
+{
+	switch (width)
+	{
+	case 8: return ZydisRegisterEncode(ZYDIS_REGCLASS_GPR8, ZydisRegisterGetId(reg));
+	case 32: return ZydisRegisterEncode(ZYDIS_REGCLASS_GPR32, ZydisRegisterGetId(reg));
+	default: return reg;
+	}
+}
+
+static ZydisEncoderOperand reg_operand(ZydisRegister reg, int width = 64)
+{
+	ZydisEncoderOperand operand = {};
+	operand.type = ZYDIS_OPERAND_TYPE_REGISTER;
+	operand.reg.value = sized(reg, width);
+	return operand;
+}
+
+static ZydisEncoderOperand mem_operand(ZydisRegister base, int64_t displacement, int width)
+{
+	ZydisEncoderOperand operand = {};
+	operand.type = ZYDIS_OPERAND_TYPE_MEMORY;
+	operand.mem.base = base;
+	operand.mem.displacement = displacement;
+	operand.mem.size = width / 8;
+	return operand;
+}
+
+static ZydisEncoderOperand imm_operand(int64_t value)
+{
+	ZydisEncoderOperand operand = {};
+	operand.type = ZYDIS_OPERAND_TYPE_IMMEDIATE;
+	operand.imm.s = value;
+	return operand;
+}
+
+vm_baseline::vm_baseline(const vm_program& handlers_)
+	: handlers(handlers_)
+{
+}
+
+vm_baseline::~vm_baseline()
+{
+	if (block.base())
+		sys::Memory::releaseMappedMemory(block);
+}
+
+bool vm_baseline::compile()
+{
+	utils::stopwatch_t timer;
+
+	code.clear();
+	fixups.clear();
+	labels.assign(handlers.size() + 1, 0);
+
+	// push rbp; mov rbp, rsp; push rbx; push rsi; mov rbx, rcx; sub rsp, 0x100
+	emit(ZYDIS_MNEMONIC_PUSH, { reg_operand(ZYDIS_REGISTER_RBP) });
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(ZYDIS_REGISTER_RBP), reg_operand(ZYDIS_REGISTER_RSP) });
+	emit(ZYDIS_MNEMONIC_PUSH, { reg_operand(ZYDIS_REGISTER_RBX) });
+	emit(ZYDIS_MNEMONIC_PUSH, { reg_operand(ZYDIS_REGISTER_RSI) });
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(ZYDIS_REGISTER_RBX), reg_operand(ZYDIS_REGISTER_RCX) });
+	emit(ZYDIS_MNEMONIC_SUB, { reg_operand(ZYDIS_REGISTER_RSP), imm_operand(0x100) });
+
+	lift_all();
+
+	for (const auto& [offset, target] : fixups)
+	{
+		int32_t displacement = (int32_t)(labels[target] - (offset + 4));
+		memcpy(&code[offset], &displacement, 4);
+	}
+
+	std::error_code error;
+	block = sys::Memory::allocateMappedMemory(code.size(), nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE, error);
+	if (error)
+	{
+		errs() << "Error allocating baseline code: " << error.message() << "\n";
+		return false;
+	}
+
+	memcpy(block.base(), code.data(), code.size());
+	if ((error = sys::Memory::protectMappedMemory(block, sys::Memory::MF_READ | sys::Memory::MF_EXEC)))
+	{
+		errs() << "Error protecting baseline code: " << error.message() << "\n";
+		return false;
+	}
+	sys::Memory::InvalidateInstructionCache(block.base(), code.size());
+
+	entry = (void(*)(cpu_state_t*))block.base();
+	compile_us = timer.elapsed_ms() * 1000;
+	return true;
+}
+
+ZydisRegister vm_baseline::scratch()
+{
+	// no handler keeps more than three values alive, so rotating through six never hands out a live one
+	ZydisRegister reg = scratch_registers[scratch_index];
+	scratch_index = (scratch_index + 1) % std::size(scratch_registers);
+	return reg;
+}
+
+void vm_baseline::emit(ZydisMnemonic mnemonic, std::initializer_list<ZydisEncoderOperand> operands)
+{
+	ZydisEncoderRequest request = {};
+	request.machine_mode = ZYDIS_MACHINE_MODE_LONG_64;
+	request.mnemonic = mnemonic;
+	request.operand_count = (ZyanU8)operands.size();
+	std::copy(operands.begin(), operands.end(), request.operands);
+
+	ZyanU8 buffer[ZYDIS_MAX_INSTRUCTION_LENGTH];
+	ZyanUSize length = sizeof(buffer);
+	if (!ZYAN_SUCCESS(ZydisEncoderEncodeInstruction(&request, buffer, &length)))
+	{
+		crashed("couldnt encode a baseline instruction");
+	}
+	code.insert(code.end(), buffer, buffer + length);
+}
+
+// rel32 is always the last four bytes of jmp and jcc, patched once every label is known
+void vm_baseline::emit_branch(ZydisMnemonic mnemonic, size_t target)
+{
+	ZydisEncoderRequest request = {};
+	request.machine_mode = ZYDIS_MACHINE_MODE_LONG_64;
+	request.mnemonic = mnemonic;
+	request.branch_type = ZYDIS_BRANCH_TYPE_NEAR;
+	request.branch_width = ZYDIS_BRANCH_WIDTH_32;
+	request.operand_count = 1;
+	request.operands[0] = imm_operand(0);
+
+	ZyanU8 buffer[ZYDIS_MAX_INSTRUCTION_LENGTH];
+	ZyanUSize length = sizeof(buffer);
+	if (!ZYAN_SUCCESS(ZydisEncoderEncodeInstruction(&request, buffer, &length)))
+	{
+		crashed("couldnt encode a baseline branch");
+	}
+	code.insert(code.end(), buffer, buffer + length);
+	fixups.emplace_back(code.size() - 4, target);
+}
+
+void vm_baseline::begin(size_t index)
+{
+	labels[index] = code.size();
+	current = index;
+	scratch_index = 0;
+}
+
+void vm_baseline::jump(size_t index)
+{
+	// handlers are emitted in program order, falling through is free
+	if (index != current + 1)
+		emit_branch(ZYDIS_MNEMONIC_JMP, index);
+}
+
+void vm_baseline::branch_nz(ZydisRegister flag, size_t taken, size_t not_taken)
+{
+	emit(ZYDIS_MNEMONIC_TEST, { reg_operand(flag), reg_operand(flag) });
+	emit_branch(ZYDIS_MNEMONIC_JNZ, taken);
+	jump(not_taken);
+}
+
+void vm_baseline::push(ZydisRegister value, int width)
+{
+	if (width == 64)
+		return emit(ZYDIS_MNEMONIC_PUSH, { reg_operand(value) });
+
+	emit(ZYDIS_MNEMONIC_SUB, { reg_operand(ZYDIS_REGISTER_RSP), imm_operand(width / 8) });
+	emit(ZYDIS_MNEMONIC_MOV, { mem_operand(ZYDIS_REGISTER_RSP, 0, width), reg_operand(value, width) });
+}
+
+ZydisRegister vm_baseline::pop(int width)
+{
+	ZydisRegister value = scratch();
+	if (width == 64)
+	{
+		emit(ZYDIS_MNEMONIC_POP, { reg_operand(value) });
+		return value;
+	}
+
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(value, width), mem_operand(ZYDIS_REGISTER_RSP, 0, width) });
+	emit(ZYDIS_MNEMONIC_ADD, { reg_operand(ZYDIS_REGISTER_RSP), imm_operand(width / 8) });
+	return value;
+}
+
+ZydisRegister vm_baseline::imm(uint64_t value, int width)
+{
+	ZydisRegister reg = scratch();
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(reg, width), imm_operand(width == 64 ? value : (uint32_t)value) });
+	return reg;
+}
+
+ZydisRegister vm_baseline::read_vreg(uint64_t index, int width)
+{
+	ZydisRegister reg = scratch();
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(reg, width), mem_operand(ZYDIS_REGISTER_RBP, vreg_offset + (int64_t)index * 8, width) });
+	return reg;
+}
+
+// narrow values are already zero extended in their register, the whole slot is written like the interpreter does
+void vm_baseline::write_vreg(uint64_t index, ZydisRegister value, int width)
+{
+	emit(ZYDIS_MNEMONIC_MOV, { mem_operand(ZYDIS_REGISTER_RBP, vreg_offset + (int64_t)index * 8, 64), reg_operand(value) });
+}
+
+ZydisRegister vm_baseline::read_vsp()
+{
+	ZydisRegister reg = scratch();
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(reg), reg_operand(ZYDIS_REGISTER_RSP) });
+	return reg;
+}
+
+void vm_baseline::write_vsp(ZydisRegister value)
+{
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(ZYDIS_REGISTER_RSP), reg_operand(value) });
+}
+
+ZydisRegister vm_baseline::load(ZydisRegister address, int width)
+{
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(address, width), mem_operand(address, 0, width) });
+	return address;
+}
+
+void vm_baseline::store(ZydisRegister address, ZydisRegister value, int width)
+{
+	emit(ZYDIS_MNEMONIC_MOV, { mem_operand(address, 0, width), reg_operand(value, width) });
+}
+
+ZydisRegister vm_baseline::alu(v_alu_t kind, ZydisRegister lhs, ZydisRegister rhs, int width)
+{
+	ZydisMnemonic mnemonic;
+	switch (kind)
+	{
+	case ALU_ADD: mnemonic = ZYDIS_MNEMONIC_ADD; break;
+	case ALU_SUB: mnemonic = ZYDIS_MNEMONIC_SUB; break;
+	case ALU_OR: mnemonic = ZYDIS_MNEMONIC_OR; break;
+	case ALU_AND: mnemonic = ZYDIS_MNEMONIC_AND; break;
+	case ALU_XOR: mnemonic = ZYDIS_MNEMONIC_XOR; break;
+	default:
+		crashed("encountered an unknown alu operation");
+	}
+
+	emit(mnemonic, { reg_operand(lhs, width), reg_operand(rhs, width) });
+	return lhs;
+}
+
+// test; setz; movzx; neg gives the all-ones or zero the other backends push
+ZydisRegister vm_baseline::zero_flag(ZydisRegister result, int width)
+{
+	ZydisRegister flag = scratch();
+	emit(ZYDIS_MNEMONIC_TEST, { reg_operand(result, width), reg_operand(result, width) });
+	emit(ZYDIS_MNEMONIC_SETZ, { reg_operand(flag, 8) });
+	emit(ZYDIS_MNEMONIC_MOVZX, { reg_operand(flag, 32), reg_operand(flag, 8) });
+	emit(ZYDIS_MNEMONIC_NEG, { reg_operand(flag) });
+	return flag;
+}
+
+ZydisRegister vm_baseline::read_context(v_context_t reg)
+{
+	ZydisRegister value = scratch();
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(value), mem_operand(ZYDIS_REGISTER_RBX, reg * 8, 64) });
+	return value;
+}
+
+void vm_baseline::write_context(v_context_t reg, ZydisRegister value)
+{
+	emit(ZYDIS_MNEMONIC_MOV, { mem_operand(ZYDIS_REGISTER_RBX, reg * 8, 64), reg_operand(value) });
+}
+
+// the vsp is rarely 16 byte aligned, rsi keeps it across the aligned call frame
+void vm_baseline::call(ZydisRegister target)
+{
+	static const std::pair<v_context_t, ZydisRegister> arguments[] =
+	{
+		{ CTX_RCX, ZYDIS_REGISTER_RCX }, { CTX_RDX, ZYDIS_REGISTER_RDX }, { CTX_R8, ZYDIS_REGISTER_R8 }, { CTX_R9, ZYDIS_REGISTER_R9 }
+	};
+
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(ZYDIS_REGISTER_R11), reg_operand(target) });
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(ZYDIS_REGISTER_RSI), reg_operand(ZYDIS_REGISTER_RSP) });
+	emit(ZYDIS_MNEMONIC_AND, { reg_operand(ZYDIS_REGISTER_RSP), imm_operand(-16) });
+	emit(ZYDIS_MNEMONIC_SUB, { reg_operand(ZYDIS_REGISTER_RSP), imm_operand(0x20) });
+	for (const auto& [slot, reg] : arguments)
+		emit(ZYDIS_MNEMONIC_MOV, { reg_operand(reg), mem_operand(ZYDIS_REGISTER_RBX, slot * 8, 64) });
+	emit(ZYDIS_MNEMONIC_CALL, { reg_operand(ZYDIS_REGISTER_R11) });
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(ZYDIS_REGISTER_RSP), reg_operand(ZYDIS_REGISTER_RSI) });
+	emit(ZYDIS_MNEMONIC_MOV, { mem_operand(ZYDIS_REGISTER_RBX, CTX_RAX * 8, 64), reg_operand(ZYDIS_REGISTER_RAX) });
+}
+
+void vm_baseline::vm_exit()
+{
+	// mov rsp, rbp; sub rsp, 0x10; pop rsi; pop rbx; pop rbp; ret
+	emit(ZYDIS_MNEMONIC_MOV, { reg_operand(ZYDIS_REGISTER_RSP), reg_operand(ZYDIS_REGISTER_RBP) });
+	emit(ZYDIS_MNEMONIC_SUB, { reg_operand(ZYDIS_REGISTER_RSP), imm_operand(0x10) });
+	emit(ZYDIS_MNEMONIC_POP, { reg_operand(ZYDIS_REGISTER_RSI) });
+	emit(ZYDIS_MNEMONIC_POP, { reg_operand(ZYDIS_REGISTER_RBX) });
+	emit(ZYDIS_MNEMONIC_POP, { reg_operand(ZYDIS_REGISTER_RBP) });
+	emit(ZYDIS_MNEMONIC_RET, {});
+}
+
+void benchmark_baseline(const vm_program& handlers, int iterations)
+{
+	vm_baseline baseline(handlers);
+	if (!baseline.compile())
+		return;
+
+	outs() << "[+] baseline compile: " << baseline.compile_us << " us, " << baseline.code_size() << " bytes\n";
+
+	// every run starts from the same context, and a wrong result is not worth timing
+	const cpu_state_t initial = {};
+	cpu_state_t state = initial;
+	baseline.entry(&state);
+	if (!vm_interpreter::check(vm_interpreter::reference(handlers, initial), state, "baseline"))
+		return;
+
+	utils::stopwatch_t baseline_timer;
+	for (int i = 0; i < iterations; i++)
+	{
+		state = initial;
+		baseline.entry(&state);
+	}
+	double baseline_ns = baseline_timer.elapsed_ms() * 1e6 / iterations;
+
+	vm_interpreter interpreter(handlers);
+	utils::stopwatch_t interpreter_timer;
+	for (int i = 0; i < iterations; i++)
+	{
+		interpreter.state = initial;
+		interpreter.run();
+	}
+	double interpreter_ns = interpreter_timer.elapsed_ms() * 1e6 / iterations;
+
+	outs() << "[+] baseline: " << baseline_ns << " ns/call, interpreter: " << interpreter_ns << " ns/call ("
+		<< interpreter_ns / baseline_ns << "x)\n";
+}
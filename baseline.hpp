@@ -0,0 +1,57 @@
+#pragma once
+#include "vm.hpp"
+
+#include <llvm/Support/Memory.h>
+
+// single pass template compiler: every handler becomes a few x86-64 instructions encoded with zydis, the vstack is the
+// native stack (rsp is the vsp) and the vregs live in the frame, so there is no ir and no optimization.
+// the result is void(cpu_state_t*) with the win64 convention, like the recompiled function
+class vm_baseline : public lift_core<vm_baseline>
+{
+public:
+	vm_baseline(const vm_program& handlers_);
+	~vm_baseline();
+
+	bool compile();
+
+	const vm_program handlers;
+	void (*entry)(cpu_state_t* state) = nullptr;
+	double compile_us = 0;
+	size_t code_size() const { return code.size(); }
+
+	// lift_core primitives, values are the scratch register holding them
+	void begin(size_t index);
+	void jump(size_t index);
+	void branch_nz(ZydisRegister flag, size_t taken, size_t not_taken);
+	void push(ZydisRegister value, int width);
+	ZydisRegister pop(int width);
+	ZydisRegister imm(uint64_t value, int width);
+	ZydisRegister read_vreg(uint64_t index, int width);
+	void write_vreg(uint64_t index, ZydisRegister value, int width);
+	ZydisRegister read_vsp();
+	void write_vsp(ZydisRegister value);
+	ZydisRegister load(ZydisRegister address, int width);
+	void store(ZydisRegister address, ZydisRegister value, int width);
+	ZydisRegister alu(v_alu_t kind, ZydisRegister lhs, ZydisRegister rhs, int width);
+	ZydisRegister zero_flag(ZydisRegister result, int width);
+	ZydisRegister read_context(v_context_t reg);
+	void write_context(v_context_t reg, ZydisRegister value);
+	void call(ZydisRegister target);
+	void exit_to(ZydisRegister target) {}
+	void vm_exit();
+
+private:
+	std::vector<uint8_t> code;
+	std::vector<size_t> labels;							// code offset of every handler, the last one is the exit
+	std::vector<std::pair<size_t, size_t>> fixups;		// rel32 offset, handler index
+	size_t current = 0;
+	size_t scratch_index = 0;
+	llvm::sys::MemoryBlock block;
+
+	ZydisRegister scratch();
+	void emit(ZydisMnemonic mnemonic, std::initializer_list<ZydisEncoderOperand> operands);
+	void emit_branch(ZydisMnemonic mnemonic, size_t target);
+};
+
+// compiles the handlers with the baseline compiler and reports compile latency, code size and per-call time
+void benchmark_baseline(const vm_program& handlers, int iterations);
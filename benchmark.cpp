@@ -0,0 +1,364 @@
+#include "benchmark.hpp"
+#include "baseline.hpp"
+#include "vtil_stream.hpp"
+#include "vtil_pipeline.hpp"
+#include "decoder.hpp"
+#include "cache.hpp"
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <ctime>
+#include <algorithm>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Format.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+
+static void report(const char* backend, size_t handler_count, int iterations, double ms)
+{
+	outs() << "[+] " << backend << ": " << ms * 1000 / iterations << " us/routine, "
+		<< (uint64_t)(handler_count * iterations / (ms / 1000)) << " handlers/s\n";
+}
+
+// save_routine against the compact stream on one lifted, unoptimized routine, which is the larger case
+static void benchmark_vtil_serialization(const routine* rtn)
+{
+	utils::stopwatch_t save_timer;
+	vtil::save_routine(rtn, "bench.vtil");
+	double save_ms = save_timer.elapsed_ms();
+
+	utils::stopwatch_t compact_timer;
+	{
+		std::ofstream stream("bench.vtilc", std::ios::binary);
+		vtil_stream_writer::save(rtn, stream);
+	}
+	double compact_ms = compact_timer.elapsed_ms();
+
+	std::ifstream stream("bench.vtilc", std::ios::binary);
+	utils::stopwatch_t load_timer;
+	std::unique_ptr<routine> loaded(vtil_stream_reader::load(stream));
+	double load_ms = load_timer.elapsed_ms();
+
+	outs() << "[+] vtil save_routine: " << std::filesystem::file_size("bench.vtil") << " bytes in " << save_ms << " ms, compact: "
+		<< std::filesystem::file_size("bench.vtilc") << " bytes in " << compact_ms << " ms, read back in " << load_ms << " ms";
+	if (!loaded || loaded->num_instructions() != rtn->num_instructions())
+		outs() << " (round trip mismatch)";
+	outs() << "\n";
+
+	std::filesystem::remove("bench.vtil");
+	std::filesystem::remove("bench.vtilc");
+}
+
+void benchmark_lifting(lift_session& session, const vm_program& handlers, int iterations, bool execute)
+{
+	double llvm_ms = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		vm_lifter lifter(session, handlers);
+		utils::stopwatch_t timer;
+		lifter.lift();
+		llvm_ms += timer.elapsed_ms();
+	}
+	report("llvm", handlers.size(), iterations, llvm_ms);
+
+	unsigned thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+	double parallel_ms = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		vm_lifter lifter(session, handlers);
+		utils::stopwatch_t timer;
+		lifter.lift_parallel(thread_count);
+		parallel_ms += timer.elapsed_ms();
+	}
+	report(("llvm x" + std::to_string(thread_count)).c_str(), handlers.size(), iterations, parallel_ms);
+
+	double vtil_ms = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		vtil_lifter lifter(handlers);
+		utils::stopwatch_t timer;
+		lifter.lift();
+		vtil_ms += timer.elapsed_ms();
+	}
+	report("vtil", handlers.size(), iterations, vtil_ms);
+
+	{
+		vtil_lifter lifter(handlers);
+		lifter.lift();
+		benchmark_vtil_serialization(lifter.rtn);
+	}
+
+	double baseline_ms = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		vm_baseline baseline(handlers);
+		utils::stopwatch_t timer;
+		baseline.compile();
+		baseline_ms += timer.elapsed_ms();
+	}
+	report("baseline", handlers.size(), iterations, baseline_ms);
+
+	if (!execute)
+		return;
+
+	vm_interpreter interpreter(handlers);
+	utils::stopwatch_t timer;
+	for (int i = 0; i < iterations; i++)
+		interpreter.run();
+	report("interpreter", handlers.size(), iterations, timer.elapsed_ms());
+}
+
+namespace
+{
+	// wall and cpu time of the parts of an iteration between start and stop, setup outside them is not counted
+	struct stage_timer_t
+	{
+		double real_ms = 0;
+		double cpu_ms = 0;
+		std::chrono::steady_clock::time_point real_start;
+		std::clock_t cpu_start = 0;
+
+		void start()
+		{
+			cpu_start = std::clock();
+			real_start = std::chrono::steady_clock::now();
+		}
+
+		void stop()
+		{
+			real_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - real_start).count();
+			cpu_ms += 1000.0 * (std::clock() - cpu_start) / CLOCKS_PER_SEC;
+		}
+	};
+
+	struct stage_result_t
+	{
+		std::string name;
+		int iterations;
+		double real_ms;
+		double cpu_ms;
+		size_t items;	// handlers per iteration, 0 when the stage does not go over handlers
+	};
+
+	template <typename body_t>
+	void measure(std::vector<stage_result_t>& results, std::string name, int iterations, size_t items, body_t&& body)
+	{
+		stage_timer_t timer;
+		for (int i = 0; i < iterations; i++)
+			body(timer);
+
+		outs() << "[+] " << name << ": " << format("%.1f", timer.real_ms * 1000 / iterations) << " us";
+		if (items && timer.real_ms > 0)
+			outs() << ", " << (uint64_t)(items * iterations / (timer.real_ms / 1000)) << " handlers/s";
+		outs() << "\n";
+
+		results.push_back({ std::move(name), iterations, timer.real_ms, timer.cpu_ms, items });
+	}
+
+	// VM_INIT, count - 2 handlers of vreg arithmetic that leave the vstack as they found it, and VM_EXIT
+	std::vector<handler_t> synthetic_program(size_t count)
+	{
+		std::vector<handler_t> handlers;
+		auto add = [&](v_opcode_t opcode, uint64_t data) {
+			handler_t handler;
+			handler.opcode = opcode;
+			handler.data = data;
+			handler.address = 0x1000 + (uint32_t)handlers.size() * 8;
+			handler.next_handler = handler.address + 8;
+			handler.instr_size = 8;
+			handlers.push_back(handler);
+		};
+
+		add(VM_INIT, 0x1000);
+		for (uint64_t i = 0; handlers.size() + 5 < count; i++)
+		{
+			uint64_t reg = i % 16;
+			add(PUSH_VR64, reg);
+			add(PUSH_64, 0x9E3779B97F4A7C15ull * (i + 1));
+			add(i % 2 ? SUB64 : ADD64, 0);
+			add(POP_VR64, 16);	// flags
+			add(POP_VR64, reg);
+		}
+		add(VM_EXIT, 0);
+		return handlers;
+	}
+
+	// the layout of google benchmark's --benchmark_format=json, a context object and one entry per run
+	bool write_stage_json(const std::string& path, const std::string& input_file, uint64_t routine_va, const std::vector<stage_result_t>& results)
+	{
+		std::error_code error;
+		raw_fd_ostream stream(path, error, sys::fs::OF_Text);
+		if (error)
+		{
+			errs() << "Error opening file: " << error.message() << "\n";
+			return false;
+		}
+
+		char date[32];
+		std::time_t now = std::time(nullptr);
+		std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+		json::OStream json(stream, 2);
+		json.object([&] {
+			json.attributeObject("context", [&] {
+				json.attribute("date", date);
+				json.attribute("host_name", "");
+				json.attribute("executable", std::string(tool_version));
+				json.attribute("num_cpus", (int64_t)std::max(std::thread::hardware_concurrency(), 1u));
+				json.attribute("library_build_type", "release");
+				json.attribute("llvm_version", LLVM_VERSION_STRING);
+				json.attribute("input", input_file);
+				json.attribute("routine_va", "0x" + utohexstr(routine_va, true));
+			});
+			json.attributeArray("benchmarks", [&] {
+				for (const stage_result_t& result : results)
+				{
+					json.object([&] {
+						json.attribute("name", result.name);
+						json.attribute("run_name", result.name);
+						json.attribute("run_type", "iteration");
+						json.attribute("repetitions", 1);
+						json.attribute("repetition_index", 0);
+						json.attribute("threads", 1);
+						json.attribute("iterations", result.iterations);
+						json.attribute("real_time", result.real_ms * 1e6 / result.iterations);
+						json.attribute("cpu_time", result.cpu_ms * 1e6 / result.iterations);
+						json.attribute("time_unit", "ns");
+						if (result.items && result.real_ms > 0)
+							json.attribute("items_per_second", result.items * result.iterations / (result.real_ms / 1000));
+					});
+				}
+			});
+		});
+		stream << "\n";
+		return true;
+	}
+}
+
+int benchmark_stages(const std::string& input_file, uint64_t routine_va, int iterations, const std::string& json_path)
+{
+	std::vector<stage_result_t> results;
+
+	measure(results, "pe_load", iterations, 0, [&](stage_timer_t& timer) {
+		timer.start();
+		std::unique_ptr<LIEF::PE::Binary> parsed = LIEF::PE::Parser::parse(input_file);
+		timer.stop();
+	});
+
+	std::unique_ptr<LIEF::PE::Binary> binary = LIEF::PE::Parser::parse(input_file);
+	if (!binary) {
+		crashed("Failed to load binary");
+	}
+	image_memory_t image(*binary);
+
+	std::vector<handler_t> handlers;
+	std::string error;
+	{
+		vm_decoder decoder(*binary, image);
+		if (!decoder.decode(routine_va, handlers, error))
+		{
+			errs() << "Error decoding 0x" << utohexstr(routine_va, true) << ": " << error << "\n";
+			return -1;
+		}
+	}
+
+	measure(results, "vm_entry_detection", iterations, 0, [&](stage_timer_t& timer) {
+		vm_decoder decoder(*binary, image);
+		timer.start();
+		std::optional<uint32_t> key = decoder.entry_key(routine_va);
+		timer.stop();
+		if (!key) {
+			crashed("lost the VM entry stub");
+		}
+	});
+
+	// every handler is summarized from its code the first time the decoder meets it
+	measure(results, "decode_cold", iterations, handlers.size(), [&](stage_timer_t& timer) {
+		std::vector<handler_t> decoded;
+		timer.start();
+		vm_decoder decoder(*binary, image);
+		decoder.decode(routine_va, decoded, error);
+		timer.stop();
+	});
+
+	{
+		vm_decoder decoder(*binary, image);
+		std::vector<handler_t> decoded;
+		decoder.decode(routine_va, decoded, error);
+		measure(results, "decode_warm", iterations, handlers.size(), [&](stage_timer_t& timer) {
+			decoded.clear();
+			timer.start();
+			decoder.decode(routine_va, decoded, error);
+			timer.stop();
+		});
+	}
+
+	std::vector<uint64_t> handler_addresses;
+	for (const handler_t& handler : handlers)
+	{
+		if (handler.next_handler)
+			handler_addresses.push_back(image.image_base + handler.next_handler);
+	}
+	std::sort(handler_addresses.begin(), handler_addresses.end());
+	handler_addresses.erase(std::unique(handler_addresses.begin(), handler_addresses.end()), handler_addresses.end());
+
+	measure(results, "handler_analysis", iterations, handler_addresses.size(), [&](stage_timer_t& timer) {
+		semantics_cache semantics(*binary);
+		timer.start();
+		for (uint64_t address : handler_addresses)
+			semantics.summarize(address);
+		timer.stop();
+	});
+
+	lift_session session;
+	session.context.setDiscardValueNames(true);
+	session.image = &image;
+
+	// llvm lifting, then each optimization level on a freshly lifted module, and the vtil lifter and pipeline
+	auto measure_lifters = [&](const std::string& suffix, const std::vector<handler_t>& program, const std::vector<OptimizationLevel>& levels) {
+		measure(results, "lift_llvm" + suffix, iterations, program.size(), [&](stage_timer_t& timer) {
+			vm_lifter lifter(session, program);
+			timer.start();
+			lifter.lift();
+			timer.stop();
+		});
+
+		for (const OptimizationLevel& level : levels)
+		{
+			std::string name = "optimize_O" + std::to_string(level.getSpeedupLevel());
+			measure(results, name + suffix, iterations, program.size(), [&](stage_timer_t& timer) {
+				vm_lifter lifter(session, program);
+				lifter.lift();
+				timer.start();
+				lifter.optimizeLLVM(level);
+				timer.stop();
+			});
+		}
+
+		measure(results, "lift_vtil" + suffix, iterations, program.size(), [&](stage_timer_t& timer) {
+			vtil_lifter lifter(program);
+			timer.start();
+			lifter.lift();
+			timer.stop();
+		});
+
+		measure(results, "optimize_vtil" + suffix, iterations, program.size(), [&](stage_timer_t& timer) {
+			vtil_lifter lifter(program);
+			lifter.lift();
+			vtil_pipeline pipeline;
+			timer.start();
+			pipeline.run(lifter.rtn);
+			timer.stop();
+		});
+	};
+
+	measure_lifters("", handlers, { OptimizationLevel::O0, OptimizationLevel::O1, OptimizationLevel::O2, OptimizationLevel::O3 });
+
+	// how the lifters and the optimizers scale with the size of the routine
+	for (size_t count : { 64u, 256u, 1024u, 4096u })
+		measure_lifters("/synthetic/" + std::to_string(count), synthetic_program(count), { OptimizationLevel::O3 });
+
+	if (!json_path.empty() && !write_stage_json(json_path, input_file, routine_va, results))
+		return -1;
+	return 0;
+}
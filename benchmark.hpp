@@ -0,0 +1,10 @@
+#pragma once
+#include "vm.hpp"
+
+// lift throughput of every lift_core backend over the same handlers, the interpreter needs mapped guest memory
+void benchmark_lifting(lift_session& session, const vm_program& handlers, int iterations, bool execute);
+
+// every stage of the pipeline on its own over the routine in input_file, then the lifters and O3 over synthetic
+// programs of growing size. json_path gets the results in google benchmark's json layout, so its compare.py can
+// diff two runs
+int benchmark_stages(const std::string& input_file, uint64_t routine_va, int iterations, const std::string& json_path);
@@ -0,0 +1,344 @@
+#include "vm.hpp"
+#include "cache.hpp"
+#include "program_file.hpp"
+#include <thread>
+#include <atomic>
+
+std::vector<vm_block_t> split_blocks(const vm_program& handlers)
+{
+	// a mapped program carries the blocks it was written with
+	if (const program_columns_t* columns = handlers.mapped())
+	{
+		std::vector<vm_block_t> blocks;
+		for (const program_block_t& block : columns->blocks)
+		{
+			std::optional<int64_t> height;
+			if (block.entry_height != INT64_MIN)
+				height = block.entry_height;
+			blocks.push_back({ block.first, block.last, height });
+		}
+		return blocks;
+	}
+
+	size_t count = handlers.size();
+
+	std::unordered_map<uint32_t, size_t> indices;
+	for (size_t i = 0; i < count; i++)
+		indices.emplace(handlers[i].address, i);
+
+	auto target_of = [&](const handler_t& handler) {
+		auto it = indices.find((uint32_t)handler.data);
+		if (it == indices.end())
+		{
+			crashed("couldnt resolve jnz address");
+		}
+		return it->second;
+	};
+
+	std::vector<bool> leaders(count + 1);
+	leaders[0] = true;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (handlers[i].opcode != JNZ)
+			continue;
+
+		leaders[i + 1] = true;
+		leaders[target_of(handlers[i])] = true;
+	}
+
+	std::vector<vm_block_t> blocks;
+	std::vector<size_t> block_at(count + 1, SIZE_MAX);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (leaders[i])
+		{
+			block_at[i] = blocks.size();
+			blocks.push_back({ i, i + 1, std::nullopt });
+		}
+		else
+			blocks.back().last = i + 1;
+	}
+
+	// entry heights, a block reached with two different heights or after POP_vsp gets none
+	enum class height_state_t { unvisited, known, unknown };
+	std::vector<height_state_t> states(blocks.size(), height_state_t::unvisited);
+	std::vector<size_t> worklist;
+
+	auto merge = [&](size_t index, std::optional<int64_t> height) {
+		size_t block = block_at[index];
+		if (block == SIZE_MAX)
+			return;
+
+		height_state_t& state = states[block];
+		if (state == height_state_t::unknown)
+			return;
+
+		if (state == height_state_t::known && height && *height == *blocks[block].entry_height)
+			return;
+
+		if (state == height_state_t::unvisited && height)
+		{
+			state = height_state_t::known;
+			blocks[block].entry_height = height;
+		}
+		else
+		{
+			state = height_state_t::unknown;
+			blocks[block].entry_height = std::nullopt;
+		}
+		worklist.push_back(block);
+	};
+
+	if (!blocks.empty())
+		merge(0, 0);
+
+	while (!worklist.empty())
+	{
+		const vm_block_t block = blocks[worklist.back()];
+		worklist.pop_back();
+
+		std::optional<int64_t> height = block.entry_height;
+		for (size_t i = block.first; i < block.last; i++)
+		{
+			const handler_t& handler = handlers[i];
+			if (handler.opcode == POP_VSP)
+				height = std::nullopt;
+			else if (height)
+				*height -= handler.desc().stack_effect;
+		}
+
+		const handler_t& last = handlers[block.last - 1];
+		if (last.opcode == JNZ)
+			merge(target_of(last), height);
+		merge(block.last, height);
+	}
+
+	return blocks;
+}
+
+Function* vm_lifter::lift_block(const vm_block_t& block, const std::string& name)
+{
+	function = Function::Create(session.fragment_t, Function::ExternalLinkage, name, module.get());
+
+	vstack_memory = function->getArg(0);
+	vsp_state = function->getArg(1);
+	vregs_state = function->getArg(2);
+	context_state = function->getArg(3);
+	vstack_memory->setName("vstack");
+	vsp_state->setName("vsp");
+	vregs_state->setName("vregs");
+	context_state->setName("state");
+
+	BasicBlock* EntryBB = BasicBlock::Create(context, "entry", function);
+	builder.SetInsertPoint(EntryBB);
+
+	// nothing carries over between fragments except what goes through the arguments
+	std::fill(vregs.begin(), vregs.end(), nullptr);
+	dirty_vregs = 0;
+	reset_vstack_tracking();
+
+	if (block.entry_height)
+	{
+		vsp = builder.CreateConstGEP1_64(builder.getInt8Ty(), vstack_memory, 2048 - *block.entry_height, "vsp");
+		vsp_in_guest = false;
+	}
+	else
+	{
+		vsp = builder.CreateLoad(builder.getPtrTy(), vsp_state, "vsp");
+		vsp_in_guest = true;
+	}
+
+	// sized once per lifter, a fragment only fills and later clears its own range
+	if (handler_blocks.size() != handlers.size())
+		handler_blocks.assign(handlers.size(), nullptr);
+	for (size_t i = block.first; i < block.last; i++)
+		handler_blocks[i] = BasicBlock::Create(context, Twine(handlers[i].parseToStr()) + "_" + Twine(i), function);
+
+	builder.CreateBr(handler_blocks[block.first]);
+
+	in_fragment = true;
+	fragment_first = block.first;
+	fragment_last = block.last;
+	lift_range(block.first, block.last);
+	in_fragment = false;
+
+	std::fill(handler_blocks.begin() + block.first, handler_blocks.begin() + block.last, nullptr);
+
+	return function;
+}
+
+void vm_lifter::reset_vstack_tracking()
+{
+	vstack_slots.clear();
+	vstack_slots_complete = false;
+	popped_values.clear();
+	untracked_pops.clear();
+	vsp_bases.clear();
+	vstack_escaped = true;
+}
+
+void vm_lifter::leave_fragment(llvm::Value* next)
+{
+	builder.CreateStore(vsp, vsp_state);
+
+	for (uint64_t i = 0; i < vregs.size(); i++)
+	{
+		if (!(dirty_vregs & (1u << i)))
+			continue;
+
+		llvm::Value* slot = builder.CreateConstGEP2_64(ArrayType::get(builder.getInt64Ty(), 32), vregs_state, 0, i);
+		builder.CreateStore(builder.CreateZExtOrTrunc(vregs[i], builder.getInt64Ty()), slot);
+	}
+
+	builder.CreateRet(next);
+}
+
+void vm_lifter::lift_parallel(unsigned thread_count, artifact_cache* cache)
+{
+	std::vector<vm_block_t> blocks = split_blocks(handlers);
+
+	// with a cache every block is its own module named after its content, identical blocks share one fragment
+	std::vector<std::string> names(blocks.size());
+	std::vector<std::string> keys(blocks.size());
+	std::vector<SmallVector<char, 0>> block_bitcode(blocks.size());
+	std::vector<size_t> pending;
+	std::unordered_map<std::string, size_t> first_with_key;
+	size_t reused = 0;
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		if (!cache)
+		{
+			names[i] = "vm_block_" + std::to_string(blocks[i].first);
+			pending.push_back(i);
+			continue;
+		}
+
+		const handler_t& last = handlers[blocks[i].last - 1];
+		std::optional<int64_t> branch_offset;
+		if (last.opcode == JNZ)
+			branch_offset = (int64_t)resolve_target(last.data) - (int64_t)blocks[i].first;
+
+		keys[i] = artifact_cache::fragment_key(handlers, blocks[i], branch_offset);
+		names[i] = "vm_block_" + keys[i];
+		if (!first_with_key.emplace(keys[i], i).second)
+			continue;
+
+		if (cache->load_fragment(keys[i], block_bitcode[i]))
+			reused++;
+		else
+			pending.push_back(i);
+	}
+
+	thread_count = (unsigned)std::max<size_t>(1, std::min<size_t>(thread_count, pending.size()));
+
+	// each worker owns a context, so fragments cross over to ours as bitcode
+	std::vector<SmallVector<char, 0>> fragments(thread_count);
+	std::atomic<size_t> next_block = 0;
+	std::vector<std::thread> workers;
+
+	for (unsigned w = 0; w < thread_count; w++)
+	{
+		workers.emplace_back([&, w] {
+			lift_session local;
+			local.context.setDiscardValueNames(context.shouldDiscardValueNames());
+
+			// cached fragments cannot depend on the image, O3 folds its constants after linking instead
+			local.image = cache ? nullptr : session.image;
+
+			vm_lifter lifter(local, handlers);
+			for (size_t n; (n = next_block++) < pending.size(); )
+			{
+				size_t i = pending[n];
+				if (!cache)
+				{
+					lifter.lift_block(blocks[i], names[i]);
+					continue;
+				}
+
+				vm_lifter single(local, handlers);
+				single.lift_block(blocks[i], names[i]);
+
+				raw_svector_ostream stream(block_bitcode[i]);
+				WriteBitcodeToFile(*single.module, stream);
+				cache->store_fragment(keys[i], block_bitcode[i]);
+			}
+
+			if (!cache)
+			{
+				raw_svector_ostream stream(fragments[w]);
+				WriteBitcodeToFile(*lifter.module, stream);
+			}
+		});
+	}
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	if (cache && output.stats)
+		outs() << "; lifted " << pending.size() << " blocks, " << reused << " came from the fragment cache\n";
+
+	fragments.insert(fragments.end(), std::make_move_iterator(block_bitcode.begin()), std::make_move_iterator(block_bitcode.end()));
+
+	Linker linker(*module);
+	for (SmallVector<char, 0>& fragment : fragments)
+	{
+		if (fragment.empty())
+			continue;
+
+		auto parsed = parseBitcodeFile(MemoryBufferRef(StringRef(fragment.data(), fragment.size()), "fragment"), context);
+		if (!parsed)
+		{
+			errs() << "Error reading fragment: " << toString(parsed.takeError()) << "\n";
+			crashed("couldnt link lifted blocks");
+		}
+
+		if (linker.linkInModule(std::move(*parsed)))
+		{
+			crashed("couldnt link lifted blocks");
+		}
+	}
+
+	// devirtualized owns the state and walks the block graph, the fragments get inlined back into it by O3
+	create_devirtualized();
+
+	BasicBlock* EntryBB = BasicBlock::Create(context, "entry", function);
+	builder.SetInsertPoint(EntryBB);
+
+	AllocaInst* vstack = builder.CreateAlloca(session.vstack_t, nullptr, "vstack_memory");
+	AllocaInst* vsp_slot = builder.CreateAlloca(builder.getPtrTy(), nullptr, "vsp");
+	AllocaInst* vregs_slot = builder.CreateAlloca(ArrayType::get(builder.getInt64Ty(), 32), nullptr, "vregs");
+	builder.CreateStore(builder.CreateConstGEP1_64(builder.getInt8Ty(), vstack, 2048), vsp_slot);
+
+	std::vector<BasicBlock*> entries(handlers.size() + 1);
+	for (const vm_block_t& block : blocks)
+		entries[block.first] = BasicBlock::Create(context, "block_" + Twine(block.first), function);
+
+	exit_block = BasicBlock::Create(context, "VM_EXIT", function);
+	entries[handlers.size()] = exit_block;
+
+	builder.CreateBr(blocks.empty() ? exit_block : entries[0]);
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		const vm_block_t& block = blocks[i];
+		Function* fragment = module->getFunction(names[i]);
+		fragment->setLinkage(GlobalValue::InternalLinkage);
+		fragment->addFnAttr(Attribute::AlwaysInline);
+
+		builder.SetInsertPoint(entries[block.first]);
+		llvm::Value* next = builder.CreateCall(fragment, { vstack, vsp_slot, vregs_slot, context_state }, "next");
+
+		SwitchInst* dispatch = builder.CreateSwitch(next, entries[block.last], 1);
+		const handler_t& last = handlers[block.last - 1];
+		if (last.opcode == JNZ)
+		{
+			size_t target = resolve_target(last.data);
+			if (target != block.last)
+				dispatch->addCase(builder.getInt32((int32_t)(target - block.first)), entries[target]);
+		}
+	}
+
+	// the context was already restored by the VM_EXIT handler inside the last block
+	lift_exit();
+}
@@ -0,0 +1,322 @@
+#include "cache.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <numeric>
+#include <unordered_set>
+#include <llvm/Support/SHA256.h>
+#include <llvm/Support/Format.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+
+constexpr uint32_t cache_magic = 0x48434456;	// "VDCH"
+
+#pragma pack(push, 1)
+struct cached_handler_t
+{
+	uint8_t opcode;
+	uint64_t data;
+	uint32_t address;
+	uint32_t next_handler;
+	int32_t instr_size;
+};
+#pragma pack(pop)
+
+artifact_cache::artifact_cache(std::filesystem::path directory_)
+	: directory(std::move(directory_))
+{
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+}
+
+artifact_cache::~artifact_cache()
+{
+	flush_lookups();
+}
+
+std::string artifact_cache::key(const image_memory_t& image, uint64_t routine_va, std::string_view tier)
+{
+	SHA256 hash;
+	auto update = [&](const void* data, size_t size) {
+		hash.update(ArrayRef<uint8_t>((const uint8_t*)data, size));
+	};
+
+	// sections only, so a new timestamp, checksum or signature does not invalidate anything
+	update(&image.image_base, sizeof(image.image_base));
+	for (const image_memory_t::region_t& region : image.regions)
+	{
+		update(&region.va, sizeof(region.va));
+		update(region.content.data(), region.content.size());
+	}
+
+	update(&routine_va, sizeof(routine_va));
+	update(tool_version.data(), tool_version.size());
+	update(LLVM_VERSION_STRING, sizeof(LLVM_VERSION_STRING));
+	update(tier.data(), tier.size());
+
+	return toHex(hash.final(), true);
+}
+
+bool artifact_cache::load(const std::string& key, std::vector<handler_t>& handlers, std::string& bitcode)
+{
+	std::filesystem::path path = directory / (key + ".bin");
+	std::error_code error;
+	uint64_t file_size = std::filesystem::file_size(path, error);
+	std::ifstream stream(path, std::ios::binary);
+
+	// both counts come from the file, a damaged entry is a miss instead of a huge allocation
+	uint32_t magic = 0;
+	uint64_t handler_count = 0;
+	uint64_t bitcode_size = 0;
+	uint64_t remaining = error ? 0 : file_size;
+	if (remaining < 12 || !stream.read((char*)&magic, 4) || magic != cache_magic || !stream.read((char*)&handler_count, 8))
+	{
+		record(routine_miss);
+		return false;
+	}
+
+	remaining -= 12;
+	if (handler_count > remaining / sizeof(cached_handler_t))
+	{
+		record(routine_miss);
+		return false;
+	}
+
+	std::vector<cached_handler_t> records(handler_count);
+	remaining -= handler_count * sizeof(cached_handler_t);
+	if (remaining < 8 || !stream.read((char*)records.data(), records.size() * sizeof(cached_handler_t)) || !stream.read((char*)&bitcode_size, 8))
+	{
+		record(routine_miss);
+		return false;
+	}
+
+	remaining -= 8;
+	if (bitcode_size != remaining)
+	{
+		record(routine_miss);
+		return false;
+	}
+
+	bitcode.resize(bitcode_size);
+	if (!stream.read(bitcode.data(), bitcode_size))
+	{
+		record(routine_miss);
+		return false;
+	}
+
+	for (const cached_handler_t& cached : records)
+	{
+		if (cached.opcode >= OPCODE_COUNT)
+		{
+			record(routine_miss);
+			return false;
+		}
+	}
+
+	std::vector<handler_t> loaded;
+	std::unordered_set<uint32_t> addresses;
+	for (const cached_handler_t& cached : records)
+	{
+		handler_t handler = {};
+		handler.opcode = (v_opcode_t)cached.opcode;
+		handler.data = cached.data;
+		handler.address = cached.address;
+		handler.next_handler = cached.next_handler;
+		handler.instr_size = cached.instr_size;
+		loaded.push_back(handler);
+		addresses.insert(handler.address);
+	}
+
+	// the lifters cannot recover from a jnz that targets no handler, that entry is a miss and gets decoded again
+	for (const handler_t& handler : loaded)
+	{
+		if (handler.opcode == JNZ && !addresses.count((uint32_t)handler.data))
+		{
+			record(routine_miss);
+			return false;
+		}
+	}
+
+	handlers = std::move(loaded);
+	record(routine_hit);
+	return true;
+}
+
+bool artifact_cache::store(const std::string& key, const vm_program& handlers, llvm::Module& module)
+{
+	SmallVector<char, 0> bitcode;
+	raw_svector_ostream bitcode_stream(bitcode);
+	WriteBitcodeToFile(module, bitcode_stream);
+
+	std::string entry;
+	auto append = [&](const void* data, size_t size) {
+		entry.append((const char*)data, size);
+	};
+
+	uint64_t handler_count = handlers.size();
+	uint64_t bitcode_size = bitcode.size();
+	append(&cache_magic, 4);
+	append(&handler_count, 8);
+	for (const handler_t& handler : handlers)
+	{
+		cached_handler_t cached = { (uint8_t)handler.opcode, handler.data, handler.address, handler.next_handler, handler.instr_size };
+		append(&cached, sizeof(cached));
+	}
+	append(&bitcode_size, 8);
+	append(bitcode.data(), bitcode.size());
+
+	return write_atomically(directory / (key + ".bin"), ArrayRef<char>(entry.data(), entry.size()));
+}
+
+std::string artifact_cache::fragment_key(const vm_program& handlers, const vm_block_t& block, std::optional<int64_t> branch_offset)
+{
+	SHA256 hash;
+	auto update = [&](const void* data, size_t size) {
+		hash.update(ArrayRef<uint8_t>((const uint8_t*)data, size));
+	};
+
+	int64_t height = block.entry_height.value_or(INT64_MIN);
+	update(&height, sizeof(height));
+	for (size_t i = block.first; i < block.last; i++)
+	{
+		const handler_t& handler = handlers[i];
+		uint64_t data = handler.opcode == JNZ ? (uint64_t)branch_offset.value_or(0) : handler.data;
+		update(&handler.opcode, sizeof(handler.opcode));
+		update(&data, sizeof(data));
+	}
+
+	update(tool_version.data(), tool_version.size());
+	update(LLVM_VERSION_STRING, sizeof(LLVM_VERSION_STRING));
+
+	return toHex(hash.final(), true);
+}
+
+bool artifact_cache::load_fragment(const std::string& key, llvm::SmallVectorImpl<char>& bitcode)
+{
+	std::ifstream stream(directory / "fragments" / (key + ".bc"), std::ios::binary);
+	if (stream)
+		bitcode.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+
+	bool hit = stream && !bitcode.empty();
+	record(hit ? fragment_hit : fragment_miss);
+	return hit;
+}
+
+bool artifact_cache::store_fragment(const std::string& key, llvm::ArrayRef<char> bitcode)
+{
+	std::error_code error;
+	std::filesystem::create_directories(directory / "fragments", error);
+	return write_atomically(directory / "fragments" / (key + ".bc"), bitcode);
+}
+
+// readers only ever open the final name, and another worker that renamed first stored the same content
+bool artifact_cache::write_atomically(const std::filesystem::path& target, llvm::ArrayRef<char> content)
+{
+	std::random_device random;
+	std::filesystem::path temporary = target;
+	temporary += "." + std::to_string(random()) + ".tmp";
+
+	{
+		std::ofstream stream(temporary, std::ios::binary);
+		stream.write(content.data(), content.size());
+
+		if (!stream)
+		{
+			stream.close();
+			std::filesystem::remove(temporary);
+			return false;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporary, target, error);
+	if (error)
+	{
+		std::filesystem::remove(temporary, error);
+		return std::filesystem::exists(target);
+	}
+	return true;
+}
+
+// the counts of this run as one line, written with a single append through an O_APPEND (FILE_APPEND_DATA on
+// windows) handle so lines of processes sharing the directory never interleave
+void artifact_cache::flush_lookups()
+{
+	if (std::accumulate(std::begin(lookups), std::end(lookups), (uint64_t)0) == 0)
+		return;
+
+	std::string line;
+	for (uint64_t count : lookups)
+		line += std::to_string(count) + " ";
+	line.back() = '\n';
+
+	std::error_code error;
+	raw_fd_ostream stream((directory / "lookups.log").string(), error, sys::fs::OF_Append);
+	if (!error)
+		stream << line;
+	std::fill(std::begin(lookups), std::end(lookups), 0);
+}
+
+// sums the lines of a log, and how many there were
+static std::pair<std::array<uint64_t, 4>, size_t> read_lookups(const std::filesystem::path& path)
+{
+	std::array<uint64_t, 4> totals = {};
+	size_t lines = 0;
+	std::ifstream log(path);
+	for (std::string line; std::getline(log, line); lines++)
+	{
+		std::istringstream fields(line);
+		std::array<uint64_t, 4> counts = {};
+		if (fields >> counts[0] >> counts[1] >> counts[2] >> counts[3])
+		{
+			for (size_t i = 0; i < totals.size(); i++)
+				totals[i] += counts[i];
+		}
+	}
+	return { totals, lines };
+}
+
+void artifact_cache::report(llvm::raw_ostream& stream)
+{
+	flush_lookups();
+
+	std::filesystem::path path = directory / "lookups.log";
+	auto [totals, lines] = read_lookups(path);
+
+	// fold a long log into one line. the log is renamed away first, so later runs start a new one and only a line
+	// appended between the rename and the read can be lost. a rename that fails (an open handle on windows) leaves
+	// the log for the next run
+	if (lines > max_lookup_lines)
+	{
+		std::random_device random;
+		std::filesystem::path folding = path;
+		folding += "." + std::to_string(random()) + ".fold";
+
+		std::error_code error;
+		std::filesystem::rename(path, folding, error);
+		if (!error)
+		{
+			auto [folded, folded_lines] = read_lookups(folding);
+			raw_fd_ostream log(path.string(), error, sys::fs::OF_Append);
+			if (!error)
+			{
+				log << folded[0] << " " << folded[1] << " " << folded[2] << " " << folded[3] << "\n";
+				log.close();
+				std::filesystem::remove(folding, error);
+			}
+		}
+	}
+
+	auto rate = [&](const char* name, uint64_t hits, uint64_t misses) {
+		uint64_t total = hits + misses;
+		stream << name << hits << " hits in " << total << " lookups";
+		if (total)
+			stream << " (" << format("%.1f", 100.0 * hits / total) << "%)";
+	};
+
+	stream << "[+] cache: ";
+	rate("routines ", totals[routine_hit], totals[routine_miss]);
+	rate(", fragments ", totals[fragment_hit], totals[fragment_miss]);
+	stream << "\n";
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "vm.hpp"
+
+#include <filesystem>
+
+// bumped whenever decoding or lifting changes what a cached entry would contain
+constexpr std::string_view tool_version = "devirtualizer-2";
+
+// on-disk cache of decoded programs and their optimized bitcode, one file per key. entries are written to a
+// temporary file and renamed into place, so concurrent workers only ever see complete entries
+class artifact_cache
+{
+public:
+	artifact_cache(std::filesystem::path directory_);
+	~artifact_cache();
+
+	// sha256 over every mapped section, the image base, the entry va, the tool and llvm versions and the tier.
+	// nothing else on the command line changes the entry: with a cache the routine is always lifted through
+	// fragments, which come out the same for any --lift-threads, and the vtil passes and budget only shape the
+	// vtil output, which is not cached
+	static std::string key(const image_memory_t& image, uint64_t routine_va, std::string_view tier);
+
+	bool load(const std::string& key, std::vector<handler_t>& handlers, std::string& bitcode);
+	bool store(const std::string& key, const vm_program& handlers, llvm::Module& module);
+
+	// one lifted vm_block_t: opcodes, operands with the jnz target relative to the block, and the entry height.
+	// fragments return relative successors and are lifted without image folding, so nothing else goes in
+	static std::string fragment_key(const vm_program& handlers, const vm_block_t& block, std::optional<int64_t> branch_offset);
+
+	bool load_fragment(const std::string& key, llvm::SmallVectorImpl<char>& bitcode);
+	bool store_fragment(const std::string& key, llvm::ArrayRef<char> bitcode);
+
+	// hits and lookups of routines and of fragments, over every process that used this directory
+	void report(llvm::raw_ostream& stream);
+
+private:
+	std::filesystem::path directory;
+
+	// lookups are counted in memory, each run appends one line of counts to lookups.log when it reports or the
+	// cache goes away, and a log past max_lookup_lines is folded into a single line
+	enum lookup_t { routine_hit, routine_miss, fragment_hit, fragment_miss };
+	static constexpr size_t max_lookup_lines = 1024;
+	uint64_t lookups[4] = {};
+	void record(lookup_t lookup) { lookups[lookup]++; }
+	void flush_lookups();
+	bool write_atomically(const std::filesystem::path& target, llvm::ArrayRef<char> content);
+};
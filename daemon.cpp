@@ -0,0 +1,453 @@
+#include "daemon.hpp"
+#include "baseline.hpp"
+#include "vtil_pipeline.hpp"
+#include "vtil_stream.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <llvm/Support/SHA256.h>
+#include <llvm/Support/Format.h>
+#include <llvm/ADT/StringExtras.h>
+
+#ifdef _WIN32
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+static constexpr socket_t invalid_socket = INVALID_SOCKET;
+static void close_socket(socket_t s) { closesocket(s); }
+static bool timed_out() { return WSAGetLastError() == WSAETIMEDOUT; }
+static void set_receive_timeout(socket_t s, int ms)
+{
+	DWORD timeout = ms;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
+static constexpr socket_t invalid_socket = -1;
+static void close_socket(socket_t s) { close(s); }
+static bool timed_out() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+static void set_receive_timeout(socket_t s, int ms)
+{
+	timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static bool send_all(socket_t connection, std::string_view data)
+{
+	while (!data.empty())
+	{
+		int sent = send(connection, data.data(), (int)std::min<size_t>(data.size(), INT32_MAX), MSG_NOSIGNAL);
+		if (sent <= 0)
+			return false;
+		data.remove_prefix(sent);
+	}
+	return true;
+}
+
+// appends to buffer until it holds at least size bytes. recv times out every receive_poll_ms, so a client that
+// keeps an idle connection open cannot hold the worker, and with it the shutdown, forever
+static bool receive(socket_t connection, std::string& buffer, size_t size, const std::atomic<bool>& stopping)
+{
+	char chunk[64 * 1024];
+	while (buffer.size() < size)
+	{
+		int received = recv(connection, chunk, sizeof(chunk), 0);
+		if (received < 0 && timed_out() && !stopping)
+			continue;
+		if (received <= 0)
+			return false;
+		buffer.append(chunk, received);
+	}
+	return true;
+}
+
+static bool reply(socket_t connection, std::string_view payload, double ms)
+{
+	std::ostringstream header;
+	header << "ok " << payload.size() << " " << ms << "\n";
+	return send_all(connection, header.str()) && send_all(connection, payload);
+}
+
+static bool reply_error(socket_t connection, const std::string& message)
+{
+	return send_all(connection, "error " + message + "\n");
+}
+
+static std::optional<OptimizationLevel> parse_tier(const std::string& tier)
+{
+	if (tier == "O0")
+		return OptimizationLevel::O0;
+	if (tier == "O1")
+		return OptimizationLevel::O1;
+	if (tier == "O2")
+		return OptimizationLevel::O2;
+	if (tier == "O3")
+		return OptimizationLevel::O3;
+	return std::nullopt;
+}
+
+lift_session& vm_daemon::worker_session_t::next()
+{
+	if (!session || requests >= session_requests)
+	{
+		session.reset();
+		session = std::make_unique<lift_session>();
+		session->context.setDiscardValueNames(true);
+		requests = 0;
+	}
+	requests++;
+	return *session;
+}
+
+vm_daemon::vm_daemon(std::string socket_path_, unsigned worker_count_)
+	: socket_path(std::move(socket_path_)), worker_count(std::max(worker_count_, 1u)), listener(invalid_socket)
+{
+}
+
+int vm_daemon::run()
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+	{
+		std::cerr << "[!] Failed to initialize winsock!" << std::endl;
+		return -1;
+	}
+#endif
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path))
+	{
+		std::cerr << "[!] Socket path " << socket_path << " is too long!" << std::endl;
+		return -1;
+	}
+	memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+	// a socket file left behind by a previous daemon would fail the bind
+	std::error_code error;
+	std::filesystem::remove(socket_path, error);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == invalid_socket || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+	{
+		std::cerr << "[!] Failed to listen on " << socket_path << "!" << std::endl;
+		return -1;
+	}
+
+	outs() << "[+] daemon listening on " << socket_path << " with " << worker_count << " workers\n";
+	outs().flush();
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < worker_count; i++)
+		workers.emplace_back(&vm_daemon::worker, this);
+
+	// running out of descriptors or memory lasts until connections close, so a failing accept backs off instead
+	// of spinning, and one that keeps failing for about a minute means the listener is gone
+	int failures = 0;
+	int result = 0;
+	while (!stopping)
+	{
+		socket_t connection = accept(listener, nullptr, nullptr);
+		if (connection == invalid_socket)
+		{
+			if (stopping)
+				break;
+			if (++failures == max_accept_failures)
+			{
+				std::cerr << "[!] accept keeps failing, stopping the daemon" << std::endl;
+				stopping = true;
+				result = -1;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(std::min(1 << std::min(failures, 10), 1000)));
+			continue;
+		}
+
+		failures = 0;
+		set_receive_timeout(connection, receive_poll_ms);
+		{
+			std::lock_guard<std::mutex> lock(queue_mutex);
+			connections.push_back(connection);
+		}
+		wake.notify_one();
+	}
+
+	wake.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+
+#ifndef _WIN32
+	close_socket(listener);
+#endif
+	std::filesystem::remove(socket_path, error);
+
+	outs() << stats();
+	if (signatures)
+		signatures->report(outs());
+	return result;
+}
+
+void vm_daemon::worker()
+{
+	worker_session_t session;
+
+	while (true)
+	{
+		socket_t connection;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			wake.wait(lock, [&] { return stopping || !connections.empty(); });
+			if (connections.empty())
+				return;
+
+			connection = connections.front();
+			connections.pop_front();
+		}
+
+		serve(connection, session);
+		close_socket(connection);
+	}
+}
+
+void vm_daemon::serve(socket_t connection, worker_session_t& session)
+{
+	std::string buffer;
+	while (!stopping)
+	{
+		size_t newline;
+		while ((newline = buffer.find('\n')) == std::string::npos)
+		{
+			if (!receive(connection, buffer, buffer.size() + 1, stopping))
+				return;
+		}
+
+		std::string line = buffer.substr(0, newline);
+		buffer.erase(0, newline + 1);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		if (!handle(line, buffer, connection, session))
+			return;
+	}
+}
+
+// false when the connection is done, either it failed or it asked for the shutdown
+bool vm_daemon::handle(const std::string& line, std::string& buffer, socket_t connection, worker_session_t& session)
+{
+	if (line == "stats")
+		return reply(connection, stats(), 0);
+
+	if (line == "shutdown")
+	{
+		stopping = true;
+#ifdef _WIN32
+		closesocket(listener);
+#else
+		shutdown(listener, SHUT_RDWR);
+#endif
+		wake.notify_all();
+		reply(connection, "", 0);
+		return false;
+	}
+
+	utils::stopwatch_t timer;
+
+	request_t request;
+	std::string source;
+	std::string va;
+	std::istringstream fields(line);
+	if (!(fields >> source >> va >> request.backend >> request.tier))
+		return reply_error(connection, "expected <pe> <entry va> <backend> <tier>");
+
+	char* end = nullptr;
+	request.routine_va = strtoull(va.c_str(), &end, 0);
+	if (*end != '\0')
+		return reply_error(connection, "bad entry va " + va);
+
+	if (source[0] == '@')
+	{
+		// the image bytes follow the line, so after a bad size the stream cannot be followed and the connection ends
+		size_t size = strtoull(source.c_str() + 1, &end, 10);
+		if (source.size() == 1 || *end != '\0' || size > max_pe_size)
+		{
+			reply_error(connection, "bad image size " + source.substr(1) + ", expected @<bytes> up to " + std::to_string(max_pe_size));
+			return false;
+		}
+		if (!receive(connection, buffer, size, stopping))
+			return false;
+
+		request.pe.assign(buffer.begin(), buffer.begin() + size);
+		request.pe_name = "<" + std::to_string(size) + " bytes>";
+		buffer.erase(0, size);
+	}
+	else
+	{
+		std::ifstream file(source, std::ios::binary);
+		if (!file)
+			return reply_error(connection, "cannot open " + source);
+
+		request.pe.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		request.pe_name = source;
+	}
+
+	std::string error;
+	std::string payload = process(request, session.next(), error);
+	double ms = timer.elapsed_ms();
+
+	bool sent = error.empty() ? reply(connection, payload, ms) : reply_error(connection, error);
+	record(request, timer.elapsed_ms());
+	return sent;
+}
+
+std::shared_ptr<vm_daemon::image_entry_t> vm_daemon::open_image(const std::vector<uint8_t>& pe, std::string& error)
+{
+	SHA256 hash;
+	hash.update(ArrayRef<uint8_t>(pe.data(), pe.size()));
+	std::string key = toHex(hash.final(), true);
+
+	{
+		std::lock_guard<std::mutex> lock(images_mutex);
+		auto it = images.find(key);
+		if (it != images.end())
+			return it->second;
+	}
+
+	// parsed outside the lock, two workers racing on a new image both parse and the first one in wins
+	auto entry = std::make_shared<image_entry_t>();
+	entry->binary = LIEF::PE::Parser::parse(pe);
+	if (!entry->binary)
+	{
+		error = "not a PE file";
+		return nullptr;
+	}
+	entry->image = std::make_unique<image_memory_t>(*entry->binary);
+	entry->decoder = std::make_unique<vm_decoder>(*entry->binary, *entry->image, signatures);
+
+	std::lock_guard<std::mutex> lock(images_mutex);
+	auto [it, inserted] = images.emplace(key, entry);
+	if (!inserted)
+		return it->second;
+
+	// requests still running on an evicted image keep it alive through their shared_ptr
+	image_order.push_back(key);
+	if (image_order.size() > max_images)
+	{
+		images.erase(image_order.front());
+		image_order.pop_front();
+	}
+	return entry;
+}
+
+std::string vm_daemon::process(const request_t& request, lift_session& session, std::string& error)
+{
+	std::shared_ptr<image_entry_t> entry = open_image(request.pe, error);
+	if (!entry)
+		return {};
+
+	vm_program program;
+	{
+		std::lock_guard<std::mutex> lock(entry->mutex);
+		auto it = entry->routines.find(request.routine_va);
+		if (it == entry->routines.end())
+		{
+			std::vector<handler_t> handlers;
+			if (!entry->decoder->decode(request.routine_va, handlers, error))
+				return {};
+			it = entry->routines.emplace(request.routine_va, std::move(handlers)).first;
+		}
+		program = it->second;
+	}
+
+	if (request.backend == "llvm")
+	{
+		std::optional<OptimizationLevel> level = parse_tier(request.tier);
+		if (!level)
+		{
+			error = "unknown tier " + request.tier + ", expected O0 to O3";
+			return {};
+		}
+
+		session.image = entry->image.get();
+		vm_lifter lifter(session, program);
+		lifter.lift();
+		lifter.optimizeLLVM(*level);
+		if (verifyFunction(*lifter.function))
+		{
+			error = "the lifted function does not verify";
+			return {};
+		}
+
+		std::string bitcode;
+		raw_string_ostream stream(bitcode);
+		WriteBitcodeToFile(*lifter.module, stream);
+		stream.flush();
+		return bitcode;
+	}
+
+	if (request.backend == "vtil")
+	{
+		vtil_lifter lifter(program);
+		lifter.lift();
+
+		vtil_pipeline pipeline;
+		pipeline.run(lifter.rtn);
+
+		std::ostringstream stream;
+		vtil_stream_writer::save(lifter.rtn, stream);
+		return stream.str();
+	}
+
+	if (request.backend == "baseline")
+	{
+		vm_baseline baseline(program);
+		if (!baseline.compile())
+		{
+			error = "baseline compile failed";
+			return {};
+		}
+		return std::to_string(baseline.compile_us) + " us " + std::to_string(baseline.code_size()) + " bytes\n";
+	}
+
+	error = "unknown backend " + request.backend + ", expected llvm, vtil or baseline";
+	return {};
+}
+
+void vm_daemon::record(const request_t& request, double ms)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	latencies.push_back(ms);
+
+	outs() << "[+] " << request.pe_name << " 0x" << format_hex_no_prefix(request.routine_va, 0) << " " << request.backend << " "
+		<< request.tier << ": " << format("%.3f", ms) << " ms\n";
+	outs().flush();
+}
+
+std::string vm_daemon::stats()
+{
+	std::vector<double> sorted;
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		sorted = latencies;
+	}
+	if (sorted.empty())
+		return "requests 0\n";
+
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&](double p) {
+		return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+	};
+
+	std::ostringstream text;
+	text << "requests " << sorted.size() << " p50 " << percentile(0.50) << " ms p99 " << percentile(0.99) << " ms max " << sorted.back() << " ms\n";
+	return text.str();
+}
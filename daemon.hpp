@@ -0,0 +1,99 @@
+#pragma once
+// winsock2 has to come before anything that pulls in windows.h
+#ifdef _WIN32
+#include <winsock2.h>
+using socket_t = SOCKET;
+#else
+using socket_t = int;
+#endif
+
+#include "vm.hpp"
+#include "decoder.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+// devirtualization requests over a unix domain socket, one per line, any number per connection:
+//
+//   <pe> <entry va> <backend> <tier>   pe is a path, or @<size> with that many bytes of the image after the line
+//   stats                               latency percentiles over every request served so far
+//   shutdown                            stops accepting, requests in flight still get their reply and idle
+//                                       connections are closed
+//
+// backends are llvm (bitcode optimized at tier O0-O3), vtil (optimized routine in the compact stream format) and
+// baseline (compile statistics). replies are "ok <size> <ms>\n" followed by size bytes, or "error <message>\n".
+// parsed images keep their decoder, so the handler semantics and the decoded routines stay warm, and every worker
+// owns a lift_session, so contexts and pass pipelines are built once per session_requests requests instead of once
+// per request
+class vm_daemon
+{
+public:
+	vm_daemon(std::string socket_path_, unsigned worker_count_);
+
+	int run();
+
+	signature_db* signatures = nullptr;	// shared with every other process using the same file
+
+private:
+	// an input image and everything learned from it, shared by the requests naming the same bytes
+	struct image_entry_t
+	{
+		std::unique_ptr<LIEF::PE::Binary> binary;
+		std::unique_ptr<image_memory_t> image;
+		std::unique_ptr<vm_decoder> decoder;
+		std::map<uint64_t, std::vector<handler_t>> routines;
+		std::mutex mutex;
+	};
+
+	struct request_t
+	{
+		std::vector<uint8_t> pe;
+		std::string pe_name;
+		uint64_t routine_va;
+		std::string backend;
+		std::string tier;
+	};
+
+	static constexpr size_t max_images = 16;
+	static constexpr size_t max_pe_size = 256 << 20;
+	static constexpr size_t session_requests = 64;	// requests a worker's lift_session serves before it is rebuilt
+	static constexpr int receive_poll_ms = 500;		// how often a worker waiting on a client checks for the shutdown
+	static constexpr int max_accept_failures = 64;	// consecutive, backing off up to a second each
+
+	// the context of a lift_session keeps every type, constant and metadata node any request created, so a
+	// worker starts over with a fresh one every session_requests requests
+	struct worker_session_t
+	{
+		std::unique_ptr<lift_session> session;
+		size_t requests = 0;
+
+		lift_session& next();
+	};
+
+	std::string socket_path;
+	unsigned worker_count;
+	socket_t listener;
+	std::atomic<bool> stopping = false;
+
+	std::mutex queue_mutex;
+	std::condition_variable wake;
+	std::deque<socket_t> connections;
+
+	std::mutex images_mutex;
+	std::map<std::string, std::shared_ptr<image_entry_t>> images;
+	std::deque<std::string> image_order;	// oldest first, evicted past max_images
+
+	std::mutex stats_mutex;
+	std::vector<double> latencies;
+
+	void worker();
+	void serve(socket_t connection, worker_session_t& session);
+	bool handle(const std::string& line, std::string& buffer, socket_t connection, worker_session_t& session);
+	std::shared_ptr<image_entry_t> open_image(const std::vector<uint8_t>& pe, std::string& error);
+	std::string process(const request_t& request, lift_session& session, std::string& error);
+	void record(const request_t& request, double ms);
+	std::string stats();
+};
@@ -0,0 +1,323 @@
+#include "decoder.hpp"
+#include <set>
+#include <llvm/ADT/StringExtras.h>
+
+// constant propagation over one straight-line episode, enough to see where its VM_EXIT returns to
+class vm_exit_tracker : public lift_core<vm_exit_tracker>
+{
+public:
+	using value_t = std::optional<uint64_t>;
+
+	vm_exit_tracker(const std::vector<handler_t>& handlers_, const image_memory_t& image_)
+		: handlers(handlers_), image(image_)
+	{
+	}
+
+	const std::vector<handler_t>& handlers;
+	value_t continuation;
+
+	// lift_core primitives
+	void begin(size_t index) {}
+	void jump(size_t index) {}
+	void branch_nz(const value_t& flag, size_t taken, size_t not_taken) {}
+
+	void push(const value_t& value, int width) {
+		if (!vsp)
+			return;
+
+		*vsp -= width / 8;
+		for (int i = 0; i < width / 8; i++)
+		{
+			if (value)
+				stack[*vsp + i] = (uint8_t)(*value >> (i * 8));
+			else
+				stack.erase(*vsp + i);
+		}
+	}
+
+	value_t pop(int width) {
+		if (!vsp)
+			return std::nullopt;
+
+		uint64_t value = 0;
+		bool known = true;
+		for (int i = 0; i < width / 8; i++)
+		{
+			auto it = stack.find(*vsp + i);
+			if (it == stack.end())
+				known = false;
+			else
+				value |= (uint64_t)it->second << (i * 8);
+		}
+		*vsp += width / 8;
+		return known ? value_t(value) : std::nullopt;
+	}
+
+	value_t imm(uint64_t value, int width) { return width == 64 ? value : value & ((1ull << width) - 1); }
+	value_t read_vreg(uint64_t index, int width) { return vregs[index] ? imm(*vregs[index], width) : std::nullopt; }
+	void write_vreg(uint64_t index, const value_t& value, int width) { vregs[index] = value; }
+
+	// vsp is tracked as an offset, once it is replaced nothing on the stack can be trusted
+	value_t read_vsp() { return std::nullopt; }
+	void write_vsp(const value_t& value) { vsp = std::nullopt; }
+
+	value_t load(const value_t& address, int width) { return address ? image.read_constant(*address, width / 8) : std::nullopt; }
+	void store(const value_t& address, const value_t& value, int width) {}
+
+	value_t alu(v_alu_t kind, const value_t& lhs, const value_t& rhs, int width) {
+		return lhs && rhs ? value_t(utils::evaluate_alu(kind, *lhs, *rhs, width)) : std::nullopt;
+	}
+
+	value_t zero_flag(const value_t& result, int width) { return result ? value_t(*result == 0 ? ~0ull : 0) : std::nullopt; }
+	value_t read_context(v_context_t reg) { return context[reg]; }
+	void write_context(v_context_t reg, const value_t& value) { context[reg] = value; }
+
+	// win64 volatile registers do not survive the callee
+	void call(const value_t& target) {
+		for (v_context_t reg : { CTX_RAX, CTX_RCX, CTX_RDX, CTX_R8, CTX_R9, CTX_R10, CTX_R11, CTX_RFLAGS })
+			context[reg] = std::nullopt;
+	}
+
+	void exit_to(const value_t& target) { continuation = target; }
+	void vm_exit() {}
+
+private:
+	const image_memory_t& image;
+	std::map<int64_t, uint8_t> stack;
+	std::optional<int64_t> vsp = 0;
+	value_t vregs[32];
+	value_t context[CTX_COUNT];
+};
+
+vm_decoder::vm_decoder(LIEF::PE::Binary& binary_, const image_memory_t& image_, signature_db* signatures)
+	: binary(binary_), image(image_), semantics(binary_, signatures)
+{
+}
+
+std::optional<uint32_t> vm_decoder::entry_key(uint64_t routine_va)
+{
+	auto routine_content = binary.get_content_from_virtual_address(routine_va, 10);
+	auto vm_entry_disassembly = disassemble(routine_content, routine_va, ZYDIS_MNEMONIC_JMP);
+
+	if (vm_entry_disassembly.size() < 2 ||
+		vm_entry_disassembly[0].i.mnemonic != ZYDIS_MNEMONIC_PUSH || vm_entry_disassembly[0].operands[0].type != ZYDIS_OPERAND_TYPE_IMMEDIATE ||
+		vm_entry_disassembly[1].i.mnemonic != ZYDIS_MNEMONIC_JMP || vm_entry_disassembly[1].operands[0].type != ZYDIS_OPERAND_TYPE_IMMEDIATE ||
+		vm_entry_disassembly[1].operands[0].imm.is_relative == false)
+	{
+		return std::nullopt;
+	}
+
+	const native_instruction_t& jmp = vm_entry_disassembly[1];
+	dispatcher = jmp.address + jmp.i.length + jmp.operands[0].imm.value.s;
+
+	return (uint32_t)vm_entry_disassembly[0].operands[0].imm.value.u;
+}
+
+bool vm_decoder::decode(uint64_t routine_va, std::vector<handler_t>& handlers, std::string& error)
+{
+	std::optional<uint32_t> entry = entry_key(routine_va);
+	if (!entry)
+	{
+		error = "no VM entry stub at the routine";
+		return false;
+	}
+
+	uint32_t key = *entry;
+	std::set<uint32_t> decoded;
+
+	while (true)
+	{
+		size_t first = handlers.size();
+		decoded.insert(key);
+		if (!decode_bytecode(key, handlers, error))
+			return false;
+
+		// an exit nobody can resolve returns to the caller of the routine
+		auto continuation = resolve_continuation(handlers, first);
+		if (!continuation)
+			break;
+
+		std::vector<handler_t> native;
+		auto next_key = decode_native(*continuation, native);
+		if (!next_key)
+		{
+			std::cerr << "[!] Not stitching the VM exit to 0x" << std::hex << *continuation << std::dec << std::endl;
+			break;
+		}
+
+		if (decoded.count(*next_key))
+		{
+			std::cerr << "[!] Re-entry into already decoded bytecode 0x" << std::hex << *next_key << std::dec << " is not stitched" << std::endl;
+			break;
+		}
+
+		handlers.insert(handlers.end(), native.begin(), native.end());
+		key = *next_key;
+	}
+
+	// the lifters resolve jnz targets by address and cannot recover from one that is not a handler
+	std::set<uint32_t> addresses;
+	for (const handler_t& handler : handlers)
+		addresses.insert(handler.address);
+
+	for (const handler_t& handler : handlers)
+	{
+		if (handler.opcode == JNZ && !addresses.count((uint32_t)handler.data))
+		{
+			error = "jnz at bytecode 0x" + utohexstr(handler.address, true) + " targets 0x" + utohexstr((uint32_t)handler.data, true) + ", which is not a handler";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool vm_decoder::decode_bytecode(uint32_t key, std::vector<handler_t>& handlers, std::string& error)
+{
+	auto virtual_instr_content = binary.get_content_from_virtual_address(image.image_base + key, 100000);
+	if (virtual_instr_content.size() < 4)
+	{
+		error = "bytecode 0x" + utohexstr(key, true) + " is out of the image";
+		return false;
+	}
+
+	handler_t entry = {};
+	entry.opcode = VM_INIT;
+	entry.data = key;	// pushed by the entry stub
+	entry.address = key;
+	entry.instr_size = 4;
+	memcpy(&entry.next_handler, &virtual_instr_content[0], 4);
+	handlers.push_back(entry);
+
+	size_t i = entry.instr_size;
+	while (i < virtual_instr_content.size())
+	{
+		uint64_t handler_address = image.image_base + handlers.back().next_handler;
+		const handler_summary_t& summary = semantics.summarize(handler_address);
+
+		handler_t handler = {};
+		handler.opcode = summary.opcode;
+		handler.instr_size = summary.instr_size;
+
+		handler.address = key + (uint32_t)i;
+		if (handler.opcode == VM_EXIT)
+		{
+			handlers.push_back(handler);
+			return true;
+		}
+
+		// a guessed size or a no-op would lift the rest of the stream from the wrong offset
+		if (handler.opcode == UNKNOWN)
+		{
+			error = "handler 0x" + utohexstr(handler_address, true) + " at bytecode 0x" + utohexstr(handler.address, true) + " matches no opcode";
+			return false;
+		}
+
+		if (i + handler.instr_size >= virtual_instr_content.size() || handler.instr_size < 4)
+			break;
+
+		memcpy(&handler.data, &virtual_instr_content[i], handler.instr_size - 4);
+		memcpy(&handler.next_handler, &virtual_instr_content[i + handler.instr_size - 4], 4);
+
+		i += handler.instr_size;
+		handlers.push_back(handler);
+	}
+
+	// the stream ran out before its exit handler, restore the context where it stopped
+	handler_t exit = {};
+	exit.opcode = VM_EXIT;
+	exit.address = key + (uint32_t)i;
+	handlers.push_back(exit);
+	return true;
+}
+
+std::optional<uint64_t> vm_decoder::resolve_continuation(const std::vector<handler_t>& handlers, size_t first)
+{
+	vm_exit_tracker tracker(handlers, image);
+	for (size_t i = first; i < handlers.size(); i++)
+	{
+		// the tracker walks the listing and does not merge states per path, past a branch the exit could come
+		// from either side
+		if (handlers[i].opcode == JNZ)
+		{
+			std::cerr << "[!] Not stitching the VM exit at bytecode 0x" << std::hex << handlers.back().address << std::dec
+				<< ", the episode branches before it" << std::endl;
+			return std::nullopt;
+		}
+		tracker.step(i);
+	}
+
+	return tracker.continuation;
+}
+
+std::optional<uint32_t> vm_decoder::decode_native(uint64_t va, std::vector<handler_t>& handlers)
+{
+	std::optional<uint32_t> pushed;
+
+	// native stretches between episodes are short, anything long is not a call-out
+	for (int count = 0; count < 64;)
+	{
+		auto instructions = disassemble(binary.get_content_from_virtual_address(va, 64), va, ZYDIS_MNEMONIC_JMP);
+		if (instructions.empty())
+			return std::nullopt;
+
+		for (const native_instruction_t& instruction : instructions)
+		{
+			const auto& operand = instruction.operands[0];
+			uint64_t next = instruction.address + instruction.i.length;
+			count++;
+
+			if (pushed && instruction.i.mnemonic != ZYDIS_MNEMONIC_JMP)
+				return std::nullopt;
+
+			handler_t handler = {};
+			handler.address = (uint32_t)(instruction.address - image.image_base);
+			handler.instr_size = instruction.i.length;
+
+			switch (instruction.i.mnemonic)
+			{
+			case ZYDIS_MNEMONIC_PUSH:
+				if (operand.type != ZYDIS_OPERAND_TYPE_IMMEDIATE)
+					return std::nullopt;
+				pushed = (uint32_t)operand.imm.value.u;
+				break;
+			case ZYDIS_MNEMONIC_CALL:
+				if (operand.type == ZYDIS_OPERAND_TYPE_MEMORY && operand.mem.base == ZYDIS_REGISTER_RIP && operand.mem.index == ZYDIS_REGISTER_NONE)
+				{
+					handler.opcode = CALL_IMPORT;
+					handler.data = next + operand.mem.disp.value;
+				}
+				else if (operand.type == ZYDIS_OPERAND_TYPE_IMMEDIATE && operand.imm.is_relative)
+				{
+					handler.opcode = CALL_NATIVE;
+					handler.data = next + operand.imm.value.s;
+				}
+				else
+					return std::nullopt;
+				handlers.push_back(handler);
+				break;
+			case ZYDIS_MNEMONIC_JMP:
+			{
+				if (operand.type != ZYDIS_OPERAND_TYPE_IMMEDIATE || !operand.imm.is_relative)
+					return std::nullopt;
+
+				uint64_t target = next + operand.imm.value.s;
+				if (pushed)
+					return target == dispatcher ? pushed : std::nullopt;
+
+				va = target;
+				break;
+			}
+			default:
+				// only call-outs are lifted, other native code would need an x86 lifter of its own
+				return std::nullopt;
+			}
+
+			if (instruction.i.mnemonic == ZYDIS_MNEMONIC_JMP)
+				break;
+			va = next;
+		}
+	}
+
+	return std::nullopt;
+}
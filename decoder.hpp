@@ -0,0 +1,27 @@
+#pragma once
+#include "semantics.hpp"
+
+// turns a virtualized routine into handlers, following each VM_EXIT through native call-outs into the next VM entry
+// so one handler list, and later one function, covers every episode of the routine
+class vm_decoder
+{
+public:
+	vm_decoder(LIEF::PE::Binary& binary_, const image_memory_t& image_, signature_db* signatures = nullptr);
+
+	// false with the reason in error when there is no entry stub, the bytecode is outside the image, a handler
+	// matches no opcode or a jnz targets no handler, so nothing the lifters are given can make them exit
+	bool decode(uint64_t routine_va, std::vector<handler_t>& handlers, std::string& error);
+
+	// the key pushed by the push imm; jmp vm_entry stub at the routine, also remembers the dispatcher
+	std::optional<uint32_t> entry_key(uint64_t routine_va);
+
+private:
+	LIEF::PE::Binary& binary;
+	const image_memory_t& image;
+	uint64_t dispatcher = 0;	// jmp target shared by the push imm; jmp entry stubs
+	semantics_cache semantics;
+
+	bool decode_bytecode(uint32_t key, std::vector<handler_t>& handlers, std::string& error);
+	std::optional<uint64_t> resolve_continuation(const std::vector<handler_t>& handlers, size_t first);
+	std::optional<uint32_t> decode_native(uint64_t va, std::vector<handler_t>& handlers);
+};
@@ -0,0 +1,107 @@
+#include "image.hpp"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+image_memory_t::image_memory_t(LIEF::PE::Binary& binary)
+	: image_base(binary.optional_header().imagebase())
+{
+	for (LIEF::PE::Section& section : binary.sections())
+	{
+		region_t region = {};
+		region.va = image_base + section.virtual_address();
+		region.writable = (section.characteristics() & SCN_MEM_WRITE) != 0;
+
+		auto content = section.content();
+		region.content.assign(content.begin(), content.end());
+		if (region.content.size() < section.virtual_size())
+			region.content.resize(section.virtual_size(), 0);
+
+		regions.push_back(std::move(region));
+	}
+
+	if (binary.has_imports())
+	{
+		for (LIEF::PE::Import& import : binary.imports())
+		{
+			uint64_t iat = image_base + import.import_address_table_rva();
+			loader_written.emplace_back(iat, iat + (import.entries().size() + 1) * sizeof(uint64_t));
+		}
+	}
+}
+
+const image_memory_t::region_t* image_memory_t::find_region(uint64_t va, int size) const
+{
+	for (const region_t& region : regions)
+	{
+		if (va >= region.va && va + size <= region.va + region.content.size())
+			return &region;
+	}
+	return nullptr;
+}
+
+std::optional<uint64_t> image_memory_t::read_constant(uint64_t va, int size) const
+{
+	if (size <= 0 || size > 8)
+		return std::nullopt;
+
+	const region_t* region = find_region(va, size);
+	if (!region || region->writable)
+		return std::nullopt;
+
+	for (auto& [begin, end] : loader_written)
+	{
+		if (va < end && va + size > begin)
+			return std::nullopt;
+	}
+
+	uint64_t value = 0;
+	memcpy(&value, &region->content[va - region->va], size);
+	return value;
+}
+
+
+guest_memory_t::guest_memory_t(const image_memory_t& image)
+{
+	for (const image_memory_t::region_t& region : image.regions)
+		size = std::max<size_t>(size, region.va + region.content.size() - image.image_base);
+	size = (size + 0xFFF) & ~size_t(0xFFF);
+
+#ifdef _WIN32
+	base = VirtualAlloc((void*)image.image_base, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	base = mmap((void*)image.image_base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (base == MAP_FAILED)
+		base = nullptr;
+#endif
+
+	if (base != (void*)image.image_base)
+	{
+		std::cerr << "[!] Failed to map guest memory at 0x" << std::hex << image.image_base << std::dec << std::endl;
+#ifndef _WIN32
+		if (base)
+			munmap(base, size);
+#endif
+		base = nullptr;
+		return;
+	}
+
+	for (const image_memory_t::region_t& region : image.regions)
+		memcpy((void*)region.va, region.content.data(), region.content.size());
+}
+
+guest_memory_t::~guest_memory_t()
+{
+	if (!base)
+		return;
+
+#ifdef _WIN32
+	VirtualFree(base, 0, MEM_RELEASE);
+#else
+	munmap(base, size);
+#endif
+}
\ No newline at end of file
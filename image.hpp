@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <optional>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#include "binary.hpp"
+
+// read access to the mapped input image, used to fold loads from read-only sections
+class image_memory_t
+{
+public:
+	static constexpr uint32_t SCN_MEM_WRITE = 0x80000000;
+
+	struct region_t
+	{
+		uint64_t va;
+		std::vector<uint8_t> content;
+		bool writable;
+	};
+
+	uint64_t image_base;
+	std::vector<region_t> regions;
+
+	image_memory_t(LIEF::PE::Binary& binary);
+
+	const region_t* find_region(uint64_t va, int size) const;
+	std::optional<uint64_t> read_constant(uint64_t va, int size) const;
+
+private:
+	// ranges the loader writes to even though they live in read-only sections (IAT)
+	std::vector<std::pair<uint64_t, uint64_t>> loader_written;
+};
+
+
+// the image mapped at its preferred base so lifted code can dereference guest addresses in-process
+class guest_memory_t
+{
+public:
+	guest_memory_t(const image_memory_t& image);
+	~guest_memory_t();
+
+	bool mapped() const { return base != nullptr; }
+
+private:
+	void* base = nullptr;
+	size_t size = 0;
+};
\ No newline at end of file
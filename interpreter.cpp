@@ -0,0 +1,47 @@
+#include "vm.hpp"
+
+vm_interpreter::vm_interpreter(const vm_program& handlers_)
+	: handlers(handlers_)
+{
+}
+
+void vm_interpreter::run()
+{
+	reset();
+	execute();
+}
+
+cpu_state_t vm_interpreter::reference(const vm_program& handlers, const cpu_state_t& initial)
+{
+	auto interpreter = std::make_unique<vm_interpreter>(handlers);
+	interpreter->state = initial;
+	interpreter->run();
+	return interpreter->state;
+}
+
+bool vm_interpreter::check(const cpu_state_t& expected, const cpu_state_t& actual, const char* tier)
+{
+	for (int reg = 0; reg < CTX_COUNT; reg++)
+	{
+		uint64_t want = reg == CTX_RFLAGS ? expected.rflags : expected.gpr[reg];
+		uint64_t got = reg == CTX_RFLAGS ? actual.rflags : actual.gpr[reg];
+		if (want != got)
+		{
+			std::cerr << "[!] " << tier << " leaves " << context_names[reg] << " = 0x" << std::hex << got << ", the interpreter 0x" << want
+				<< std::dec << ", not timing it" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+uint64_t vm_interpreter::alu(v_alu_t kind, uint64_t lhs, uint64_t rhs, int width)
+{
+	return utils::evaluate_alu(kind, lhs, rhs, width);
+}
+
+void vm_interpreter::call(uint64_t target)
+{
+	using native_t = uint64_t(*)(uint64_t, uint64_t, uint64_t, uint64_t);
+	state[CTX_RAX] = ((native_t)target)(state[CTX_RCX], state[CTX_RDX], state[CTX_R8], state[CTX_R9]);
+}
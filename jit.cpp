@@ -0,0 +1,101 @@
+#include "jit.hpp"
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+
+vm_jit::vm_jit()
+{
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+
+	auto created = orc::LLJITBuilder().create();
+	if (!created)
+	{
+		errs() << "Error creating LLJIT: " << toString(created.takeError()) << "\n";
+		return;
+	}
+	jit = std::move(*created);
+}
+
+bool vm_jit::compile(llvm::Module& module)
+{
+	utils::stopwatch_t timer;
+
+	void* symbol = add(module, "devirtualized");
+	if (!symbol)
+		return false;
+
+	entry = (void(*)(cpu_state_t*))symbol;
+	compile_ms = timer.elapsed_ms();
+	return true;
+}
+
+void* vm_jit::add(llvm::Module& module, llvm::StringRef name)
+{
+	if (!jit)
+		return nullptr;
+
+	// the jit owns its context, so the module is moved across through bitcode
+	SmallVector<char, 0> buffer;
+	raw_svector_ostream stream(buffer);
+	WriteBitcodeToFile(module, stream);
+
+	auto context = std::make_unique<LLVMContext>();
+	auto parsed = parseBitcodeFile(MemoryBufferRef(StringRef(buffer.data(), buffer.size()), "devirt_module"), *context);
+	if (!parsed)
+	{
+		errs() << "Error reading module: " << toString(parsed.takeError()) << "\n";
+		return nullptr;
+	}
+
+	if (auto error = jit->addIRModule(orc::ThreadSafeModule(std::move(*parsed), std::move(context))))
+	{
+		errs() << "Error adding module: " << toString(std::move(error)) << "\n";
+		return nullptr;
+	}
+
+	auto symbol = jit->lookup(name);
+	if (!symbol)
+	{
+		errs() << "Error looking up " << name << ": " << toString(symbol.takeError()) << "\n";
+		return nullptr;
+	}
+
+	return symbol->toPtr<void*>();
+}
+
+void benchmark_execution(const vm_program& handlers, llvm::Module& module, int iterations)
+{
+	vm_jit jit;
+	if (!jit.compile(module))
+		return;
+
+	outs() << "[+] jit compile: " << jit.compile_ms << " ms\n";
+
+	// every run starts from the same context, and a wrong result is not worth timing
+	const cpu_state_t initial = {};
+	cpu_state_t state = initial;
+	jit.entry(&state);
+	if (!vm_interpreter::check(vm_interpreter::reference(handlers, initial), state, "jit"))
+		return;
+
+	utils::stopwatch_t jit_timer;
+	for (int i = 0; i < iterations; i++)
+	{
+		state = initial;
+		jit.entry(&state);
+	}
+	double jit_ns = jit_timer.elapsed_ms() * 1e6 / iterations;
+
+	vm_interpreter interpreter(handlers);
+	utils::stopwatch_t interpreter_timer;
+	for (int i = 0; i < iterations; i++)
+	{
+		interpreter.state = initial;
+		interpreter.run();
+	}
+	double interpreter_ns = interpreter_timer.elapsed_ms() * 1e6 / iterations;
+
+	outs() << "[+] jit: " << jit_ns << " ns/call, interpreter: " << interpreter_ns << " ns/call ("
+		<< interpreter_ns / jit_ns << "x)\n";
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "vm.hpp"
+
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+
+// compiles the optimized devirtualized module in-process and exposes it as a callable function
+class vm_jit
+{
+public:
+	vm_jit();
+	bool compile(llvm::Module& module);
+
+	// adds a module and returns the address of one of its functions, nullptr when it fails
+	void* add(llvm::Module& module, llvm::StringRef name);
+
+	void (*entry)(cpu_state_t* state) = nullptr;
+	double compile_ms = 0;
+
+private:
+	std::unique_ptr<llvm::orc::LLJIT> jit;
+};
+
+// runs the jitted function and the interpreter over the same handlers and reports per-call time
+void benchmark_execution(const vm_program& handlers, llvm::Module& module, int iterations);
@@ -0,0 +1,193 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+// shared walk over the decoded handlers. every opcode is expressed through a few backend primitives
+// (push, pop, vregs, vsp, alu, memory and branches), so the stack and flag modeling exists once and
+// each backend only decides what a value is. dispatch is resolved at compile time through CRTP.
+//
+// a backend provides:
+//   begin(index)                      start emitting/executing the handler at index, index == size() is the exit
+//   jump(index), branch_nz(flag, taken, not_taken)
+//   push(value, width), pop(width), imm(value, width)
+//   read_vreg(index, width), write_vreg(index, value, width), read_vsp(), write_vsp(value)
+//   load(address, width), store(address, value, width)
+//   alu(kind, lhs, rhs, width), zero_flag(result, width)
+//   read_context(reg), write_context(reg, value)   native registers, 64 bits wide
+//   call(target)                                    win64 call with rcx, rdx, r8, r9 from the context, result in rax
+//   exit_to(target)                                 VM_EXIT popped its native continuation
+//   vm_exit()                                       return to the native caller
+template <typename backend_t>
+class lift_core
+{
+public:
+	// program order, for backends that translate every handler once
+	void lift_all()
+	{
+		backend_t& backend = self();
+		size_t count = backend.handlers.size();
+
+		lift_range(0, count);
+		lift_exit();
+	}
+
+	// the return lives at index handlers.size(), the decoder ends every routine with a VM_EXIT that restored the context
+	void lift_exit()
+	{
+		backend_t& backend = self();
+		backend.begin(backend.handlers.size());
+		backend.vm_exit();
+	}
+
+	// handlers [first, last) only, jumps that leave the range are handed to the backend like any other
+	void lift_range(size_t first, size_t last)
+	{
+		backend_t& backend = self();
+		for (size_t i = first; i < last; i++)
+		{
+			backend.begin(i);
+			if (step(i))
+				backend.jump(i + 1);
+		}
+	}
+
+	// control flow order, for backends that execute; jump and branch_nz set backend.next
+	void execute()
+	{
+		backend_t& backend = self();
+		size_t count = backend.handlers.size();
+
+		backend.next = 0;
+		while (backend.next < count)
+		{
+			size_t i = backend.next;
+			backend.begin(i);
+			if (step(i))
+				backend.jump(i + 1);
+		}
+
+		lift_exit();
+	}
+
+	// returns false when the handler ended in a branch the backend already emitted
+	bool step(size_t index)
+	{
+		backend_t& backend = self();
+		const handler_t& handler = backend.handlers[index];
+		const opcode_desc_t& desc = handler.desc();
+
+		switch (handler.opcode)
+		{
+		case VM_INIT:
+			enter_context(handler.data);
+			break;
+		case VM_EXIT:
+			exit_context();
+			backend.exit_to(backend.pop(64));
+			break;
+		case CALL_NATIVE:
+			backend.call(backend.imm(handler.data, 64));
+			break;
+		case CALL_IMPORT:
+			backend.call(backend.load(backend.imm(handler.data, 64), 64));
+			break;
+		case POP_VR64:
+		case POP_VR32:
+			backend.write_vreg(handler.data, backend.pop(desc.width), desc.width);
+			break;
+		case PUSH_VR64:
+		case PUSH_VR32:
+			backend.push(backend.read_vreg(handler.data, desc.width), desc.width);
+			break;
+		case PUSH_VSP:
+			backend.push(backend.read_vsp(), 64);
+			break;
+		case POP_VSP:
+			backend.write_vsp(backend.pop(64));
+			break;
+		case PUSH_64:
+		case PUSH_32:
+			backend.push(backend.imm(handler.data, desc.width), desc.width);
+			break;
+		case WRITE32:
+		{
+			auto address = backend.pop(64);
+			auto value = backend.pop(32);
+			backend.store(address, value, 32);
+			break;
+		}
+		case LOAD32:
+		case LOAD64:
+		{
+			auto address = backend.pop(64);
+			backend.push(backend.load(address, desc.width), desc.width);
+			break;
+		}
+		case JNZ:
+		{
+			auto flag = backend.pop(64);
+			backend.branch_nz(flag, resolve_target(handler.data), index + 1);
+			return false;
+		}
+		default:
+		{
+			// an UNKNOWN handler stays a no-op as it always was: the decoder refuses such routines, but a program
+			// file or cache entry written before that can still hold one, and exiting here would take the daemon down
+			if (desc.alu == ALU_NONE)
+				break;
+
+			auto first = backend.pop(desc.width);
+			auto second = backend.pop(desc.width);
+			auto result = backend.alu(desc.alu, second, first, desc.width);
+
+			backend.push(result, desc.width);
+			backend.push(backend.zero_flag(result, desc.width), 64);
+			break;
+		}
+		}
+		return true;
+	}
+
+	// the entry stub pushed the key, VM_INIT pushes the native context on top of it
+	void enter_context(uint64_t key)
+	{
+		backend_t& backend = self();
+		backend.push(backend.imm(key, 64), 64);
+		for (v_context_t reg : vm_context_order)
+			backend.push(backend.read_context(reg), 64);
+		backend.push(backend.read_context(CTX_RFLAGS), 64);
+	}
+
+	// the bytecode leaves the context on the vstack, VM_EXIT pops it back into the native registers in the reverse
+	// of the entry order, rflags first
+	void exit_context()
+	{
+		backend_t& backend = self();
+		backend.write_context(CTX_RFLAGS, backend.pop(64));
+		for (auto reg = vm_context_order.rbegin(); reg != vm_context_order.rend(); ++reg)
+			backend.write_context(*reg, backend.pop(64));
+	}
+
+	size_t resolve_target(uint64_t address)
+	{
+		const auto& handlers = self().handlers;
+		if (branch_targets.empty())
+		{
+			for (size_t i = 0; i < handlers.size(); i++)
+				branch_targets.emplace(handlers[i].address, i);
+		}
+
+		auto it = branch_targets.find((uint32_t)address);
+		if (it == branch_targets.end())
+		{
+			crashed("couldnt resolve jnz address");
+		}
+		return it->second;
+	}
+
+private:
+	std::unordered_map<uint32_t, size_t> branch_targets;
+
+	backend_t& self() { return static_cast<backend_t&>(*this); }
+};
@@ -1,152 +1,174 @@
 #include "vm.hpp"
 
-vm_lifter::vm_lifter(LLVMContext& ctx, std::vector<handler_t> handlers_)
-	: context(ctx), builder(ctx), module(new Module("devirt_module", ctx)), handlers(handlers_)
+lift_session::lift_session()
 {
-	Type* int64_t = Type::getInt64Ty(context);
-	Type* void_t = Type::getVoidTy(context);
-	Type* ptr_t = PointerType::get(int64_t, 0);
+	i8_t = Type::getInt8Ty(context);
+	i32_t = Type::getInt32Ty(context);
+	i64_t = Type::getInt64Ty(context);
+	vstack_t = ArrayType::get(i8_t, 2048);
+	state_t = StructType::create(context, { ArrayType::get(i64_t, 16), i64_t }, "cpu_state");
 
-	FunctionType* FuncType = FunctionType::get(void_t, {  }, false);
-	function = Function::Create(FuncType, Function::ExternalLinkage, "devirtualized", module);
+	PointerType* ptr_t = PointerType::getUnqual(context);
+	devirtualized_t = FunctionType::get(Type::getVoidTy(context), { ptr_t }, false);
+	fragment_t = FunctionType::get(i32_t, { ptr_t, ptr_t, ptr_t, ptr_t }, false);
 
-	//rsp = &*function->arg_begin();
-	//rsp->setName("rsp");
+	PB.registerModuleAnalyses(MAM);
+	PB.registerCGSCCAnalyses(CGAM);
+	PB.registerFunctionAnalyses(FAM);
+	PB.registerLoopAnalyses(LAM);
+	PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+	PB.registerPeepholeEPCallback([this](llvm::FunctionPassManager& FPM, llvm::OptimizationLevel) {
+		FPM.addPass(image_fold_pass(this));
+	});
+}
+
+std::unique_ptr<Module> lift_session::create_module()
+{
+	return std::make_unique<Module>("devirt_module", context);
+}
+
+void lift_session::optimize(Module& module, OptimizationLevel level)
+{
+	auto it = std::find_if(pipelines.begin(), pipelines.end(), [&](auto& pipeline) { return pipeline.first == level; });
+	if (it == pipelines.end())
+	{
+		pipelines.emplace_back(level, PB.buildPerModuleDefaultPipeline(level));
+		it = pipelines.end() - 1;
+	}
+
+	it->second.run(module, MAM);
+
+	// cached results point into this module, drop them before it goes away
+	LAM.clear();
+	FAM.clear();
+	CGAM.clear();
+	MAM.clear();
+}
+
+vm_lifter::vm_lifter(lift_session& session_, const vm_program& handlers_)
+	: session(session_), context(session_.context), builder(session_.context), module(session_.create_module()), handlers(handlers_)
+{
+	MDBuilder mdb(context);
+	MDNode* domain = mdb.createAnonymousAliasScopeDomain("vm");
+	vstack_scope = MDNode::get(context, mdb.createAnonymousAliasScope(domain, "vstack"));
+	guest_scope = MDNode::get(context, mdb.createAnonymousAliasScope(domain, "guest"));
+}
+
+void vm_lifter::lift()
+{
+	create_devirtualized();
 
 	BasicBlock* EntryBB = BasicBlock::Create(context, "entry", function);
 	builder.SetInsertPoint(EntryBB);
 
-	ArrayType* stackType = ArrayType::get(builder.getInt8Ty(), 2048);
+	ArrayType* stackType = session.vstack_t;
 	AllocaInst* StackArray = builder.CreateAlloca(stackType, nullptr, "vstack_memory");
+	vstack_memory = StackArray;
 
-	vsp = builder.CreateGEP(
-		stackType, StackArray,
-		{ ConstantInt::get(builder.getInt32Ty(), 0),
-		  ConstantInt::get(builder.getInt32Ty(), 2048) },
-		"vsp"
+	vsp = builder.CreateGEP(
+		stackType, StackArray,
+		{ ConstantInt::get(builder.getInt32Ty(), 0),
+		  ConstantInt::get(builder.getInt32Ty(), 2048) },
+		"vsp"
 	);
 
-	vtil_ = new vtil_lifter(handlers);
-}
-
-void vm_lifter::liftToLLVM()
-{
+	handler_blocks.resize(handlers.size());
 	for (int i = 0; i < handlers.size(); i++)
+		handler_blocks[i] = BasicBlock::Create(context, Twine(handlers[i].parseToStr()) + "_" + Twine(i), function);
+	exit_block = BasicBlock::Create(context, "VM_EXIT", function);
+
+	merge_points.assign(handlers.size(), false);
+	for (const handler_t& handler : handlers)
 	{
-		handler_t& handler = handlers[i];
-		BasicBlock* handler_block = BasicBlock::Create(context, std::string(handler.parseToStr() + "_" + std::to_string(i)), function);
-		handler.block = handler_block;
+		if (handler.opcode == JNZ)
+			merge_points[resolve_target(handler.data)] = true;
 	}
 
-	builder.CreateBr(handlers[0].block);
+	builder.CreateBr(handler_blocks[0]);
+	lift_all();
+	untag_after_escape();
+}
 
-	for (int i = 0; i < handlers.size(); i++)
+bool vm_lifter::liftToLLVM()
+{
+	utils::stopwatch_t lift_timer;
+	if (threads > 1 || fragment_cache)
+		lift_parallel(threads, fragment_cache);
+	else
+		lift();
+	if (output.stats)
+		outs() << "; lifted " << handlers.size() << " handlers on " << std::max(threads, 1u) << " threads in " << lift_timer.elapsed_ms() << " ms\n";
+
+	size_t lifted_count = utils::count_instructions(*module);
+	utils::stopwatch_t opt_timer;
+	optimizeLLVM(llvm::OptimizationLevel::O3);
+	if (output.stats)
 	{
-		handler_t& handler = handlers[i];
-		builder.SetInsertPoint(handler.block);
+		outs() << "; O3: " << lifted_count << " -> " << utils::count_instructions(*module)
+			<< " instructions in " << opt_timer.elapsed_ms() << " ms\n";
+	}
 
-		if (i == handlers.size() - 1)
-			break;
+	if (verifyFunction(*function, &errs()))
+	{
+		errs() << "Error: the devirtualized function does not verify\n";
+		return false;
+	}
 
-		BasicBlock* next_block = handlers[i + 1].block;
-		switch (handler.opcode)
-		{
-		case VM_INIT:
-			//vm_init();
-			break;
-		case POP_VR64:
-			pop_vr64(handler);
-			break;
-		case POP_VR32:
-			pop_vr32(handler);
-			break;
-		case PUSH_VR64:
-			push_vr64(handler);
-			break;
-		case PUSH_VR32:
-			push_vr32(handler);
-			break;
-		case PUSH_VSP:
-			push_vsp();
-			break;
-		case POP_VSP:
-			pop_vsp();
-			break;
-		case PUSH_64:
-			push_64(handler);
-			break;
-		case PUSH_32:
-			push_32(handler);
-			break;
-		case SUB64:
-			sub_64(handler);
-			break;
-		case SUB32:
-			sub_32(handler);
-			break;
-		case ADD64:
-			add_64(handler);
-			break;
-		case ADD32:
-			add_32();
-			break;
-		case WRITE32:
-			write_32();
-			break;
-		case LOAD32:
-			load_32();
-			break;
-		case LOAD64:
-			load_64();
-			break;
-		case OR_32:
-			or_32();
-			break;
-		case AND_32:
-			and_32();
-			break;
-		case XOR_32:
-			xor_32();
-			break;
-		case JNZ:
-		{
-			BasicBlock* target_block = nullptr;
-			for (int j = 0; j < handlers.size(); j++)
-			{
-				if (handlers[j].address == handler.data)
-				{
-					target_block = handlers[j].block;
-					break;
-				}
-			}
-			llvm::Value* condition = jnz();
-			builder.CreateCondBr(condition, target_block, next_block);
-			continue;
-		}
-		}
+	emitLLVM();
+	return true;
+}
 
-		builder.CreateBr(next_block);
+bool vm_lifter::loadLLVM(llvm::StringRef bitcode)
+{
+	auto parsed = parseBitcodeFile(MemoryBufferRef(bitcode, "cached_module"), context);
+	if (!parsed)
+	{
+		errs() << "Error reading cached module: " << toString(parsed.takeError()) << "\n";
+		return false;
 	}
 
-	//vm_exit();
-	builder.CreateRetVoid();
-	optimizeLLVM(llvm::OptimizationLevel::O3);
+	module = std::move(*parsed);
+	function = module->getFunction("devirtualized");
+	if (!function)
+		return false;
 
-	verifyFunction(*function);
+	if (output.stats)
+		outs() << "; loaded the optimized module from the cache\n";
+	emitLLVM();
+	return true;
+}
 
-	module->print(outs(), nullptr);
+void vm_lifter::emitLLVM()
+{
+	if (output.dump)
+		module->print(outs(), nullptr);
 
-	std::error_code EC;
-	llvm::raw_fd_ostream dest("output.ll", EC, llvm::sys::fs::OF_None);
+	if (output.emit_text)
+	{
+		std::error_code EC;
+		llvm::raw_fd_ostream dest("output.ll", EC, llvm::sys::fs::OF_None);
 
-	if (EC) {
-		errs() << "Error opening file: " << EC.message() << "\n";
-	}
-	else {
-		module->print(dest, nullptr);
+		if (EC) {
+			errs() << "Error opening file: " << EC.message() << "\n";
+		}
+		else {
+			module->print(dest, nullptr);
+		}
 	}
 
-	module->~Module();
+	if (output.emit_bitcode)
+	{
+		std::error_code EC;
+		llvm::raw_fd_ostream dest("output.bc", EC, llvm::sys::fs::OF_None);
+
+		if (EC) {
+			errs() << "Error opening file: " << EC.message() << "\n";
+		}
+		else {
+			WriteBitcodeToFile(*module, dest);
+		}
+	}
 }
 
 void vm_lifter::optimizeLLVM(llvm::OptimizationLevel level)
@@ -156,83 +178,211 @@ void vm_lifter::optimizeLLVM(llvm::OptimizationLevel level)
 		return;
 	}
 
-	llvm::PassBuilder PB;
+	session.optimize(*this->module, level);
+}
 
-	llvm::LoopAnalysisManager LAM;
-	llvm::FunctionAnalysisManager FAM;
-	llvm::CGSCCAnalysisManager CGAM;
-	llvm::ModuleAnalysisManager MAM;
+BasicBlock* vm_lifter::block_of(size_t index)
+{
+	return index < handlers.size() ? handler_blocks[index] : exit_block;
+}
 
-	PB.registerModuleAnalyses(MAM);
-	PB.registerCGSCCAnalyses(CGAM);
-	PB.registerFunctionAnalyses(FAM);
-	PB.registerLoopAnalyses(LAM);
-	PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+void vm_lifter::begin(size_t index)
+{
+	builder.SetInsertPoint(block_of(index));
+	current_index = index;
 
-	llvm::ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(level);
+	// another edge into this handler may have left different values in the slots
+	if (!in_fragment && index < merge_points.size() && merge_points[index])
+	{
+		vstack_slots.clear();
+		vstack_slots_complete = false;
+	}
+}
 
-	MPM.run(*this->module, MAM);
+void vm_lifter::jump(size_t index)
+{
+	if (leaves_fragment(index))
+		return leave_fragment(builder.getInt32((int32_t)(index - fragment_first)));
+
+	builder.CreateBr(block_of(index));
 }
 
-void vm_lifter::vm_init()
+void vm_lifter::branch_nz(llvm::Value* flag, size_t taken, size_t not_taken)
 {
-	//vsp = rsp; return;
-	for (int i = 0; i <= 15; i++)
+	llvm::Value* condition = builder.CreateICmpNE(flag, builder.getInt64(0), "zf_cond");
+	if (in_fragment)
 	{
-		vpush64(rpop64());
+		llvm::Value* taken_offset = builder.getInt32((int32_t)(taken - fragment_first));
+		llvm::Value* not_taken_offset = builder.getInt32((int32_t)(not_taken - fragment_first));
+		return leave_fragment(builder.CreateSelect(condition, taken_offset, not_taken_offset, "next"));
 	}
+
+	builder.CreateCondBr(condition, block_of(taken), block_of(not_taken));
 }
 
-void vm_lifter::vm_exit()
+void vm_lifter::push(llvm::Value* value, int width)
+{
+	if (width == 64)
+		vpush64(value);
+	else
+		vpush32(value);
+}
+
+llvm::Value* vm_lifter::pop(int width)
+{
+	return width == 64 ? vpop64() : vpop32();
+}
+
+llvm::Value* vm_lifter::imm(uint64_t value, int width)
+{
+	return ConstantInt::get(builder.getIntNTy(width), width == 64 ? value : (uint32_t)value);
+}
+
+llvm::Value* vm_lifter::read_vreg(uint64_t index, int width)
 {
-	for (int i = 0; i <= 15; i++)
+	llvm::Value* value = vregs[index];
+	if (!value && in_fragment)
 	{
-		rpush64(vpop64());
+		llvm::Value* slot = builder.CreateConstGEP2_64(ArrayType::get(builder.getInt64Ty(), 32), vregs_state, 0, index);
+		value = vregs[index] = builder.CreateLoad(builder.getInt64Ty(), slot, "vr" + Twine(index));
 	}
+	if (!value)
+		return UndefValue::get(builder.getIntNTy(width));
+
+	return builder.CreateZExtOrTrunc(value, builder.getIntNTy(width));
 }
 
-void vm_lifter::pop_vr64(handler_t handler)
+void vm_lifter::write_vreg(uint64_t index, llvm::Value* value, int width)
 {
-	//builder.CreateStore(vpop64(), builder.CreatePointerCast(vregs[handler.data], builder.getInt64Ty()->getPointerTo()));
-	vregs[handler.data] = vpop64();
+	vregs[index] = value;
+	dirty_vregs |= 1u << index;
 }
 
-void vm_lifter::pop_vr32(handler_t handler)
+llvm::Value* vm_lifter::read_vsp()
 {
-	//builder.CreateStore(vpop32(), builder.CreatePointerCast(vregs[handler.data], builder.getInt32Ty()->getPointerTo()));
-	vregs[handler.data] = vpop32();
+	return builder.CreatePtrToInt(vsp, builder.getInt64Ty());
 }
 
-void vm_lifter::push_vr64(handler_t handler)
+void vm_lifter::write_vsp(llvm::Value* value)
 {
-	//vpush64(builder.CreateLoad(builder.getInt64Ty(), builder.CreatePointerCast(vregs[handler.data], builder.getInt64Ty()->getPointerTo())));
-	vpush64(vregs[handler.data]);
+	vsp = builder.CreateIntToPtr(value, builder.getInt8Ty()->getPointerTo());
+
+	// keep tracking slots when the new vsp is a known offset into vstack_memory
+	if (auto offset = vstack_address(value))
+	{
+		vsp_bases[vsp] = *offset;
+		vsp_in_guest = false;
+	}
+	else
+	{
+		vsp_in_guest = !is_vstack_derived(value);
+	}
 }
 
-void vm_lifter::push_vr32(handler_t handler)
+llvm::Value* vm_lifter::load(llvm::Value* address, int width)
 {
-	//vpush32(builder.CreateLoad(builder.getInt32Ty(), builder.CreatePointerCast(vregs[handler.data], builder.getInt32Ty()->getPointerTo())));
-	vpush32(vregs[handler.data]);
+	if (auto folded = fold_image_load(address, width / 8))
+		return imm(*folded, width);
+
+	Type* type = builder.getIntNTy(width);
+	llvm::Value* pointer = builder.CreateIntToPtr(address, type->getPointerTo());
+	llvm::LoadInst* value = builder.CreateLoad(type, pointer);
+	tag_guest_access(value, address);
+	return value;
 }
 
-void vm_lifter::push_vsp()
+void vm_lifter::store(llvm::Value* address, llvm::Value* value, int width)
 {
-	vpush64(builder.CreatePtrToInt(vsp, builder.getInt64Ty()));
+	Type* type = builder.getIntNTy(width);
+	llvm::Value* pointer = builder.CreateIntToPtr(address, type->getPointerTo());
+	tag_guest_access(builder.CreateStore(builder.CreateZExtOrTrunc(value, type), pointer), address);
+
+	if (is_vstack_derived(value))
+		mark_escaped();
+}
+
+llvm::Value* vm_lifter::alu(v_alu_t kind, llvm::Value* lhs, llvm::Value* rhs, int width)
+{
+	static constexpr Instruction::BinaryOps binary_ops[] =
+	{
+		Instruction::BinaryOpsEnd,
+		Instruction::Add,
+		Instruction::Sub,
+		Instruction::Or,
+		Instruction::And,
+		Instruction::Xor
+	};
+	static constexpr const char* names[] = { "", "add", "sub", "or", "and", "xor" };
+
+	return builder.CreateBinOp(binary_ops[kind], lhs, rhs, Twine(names[kind]) + "_" + Twine(width) + "_result");
+}
+
+llvm::Value* vm_lifter::zero_flag(llvm::Value* result, int width)
+{
+	return calc_zero_flag(result);
 }
 
-void vm_lifter::pop_vsp()
+void vm_lifter::create_devirtualized()
 {
-	vsp = builder.CreateIntToPtr(vpop64(), builder.getInt8Ty()->getPointerTo());
+	function = Function::Create(session.devirtualized_t, Function::ExternalLinkage, "devirtualized", module.get());
+
+	// the state is only reachable through this argument, which keeps it apart from guest memory and the vstack
+	context_state = function->getArg(0);
+	context_state->setName("state");
+	function->addParamAttr(0, Attribute::NoAlias);
+	function->addParamAttr(0, Attribute::NoCapture);
 }
 
-void vm_lifter::push_64(handler_t handler)
+llvm::Value* vm_lifter::context_slot(v_context_t reg)
 {
-	vpush64(ConstantInt::get(builder.getInt64Ty(), handler.data));
+	if (reg == CTX_RFLAGS)
+		return builder.CreateStructGEP(session.state_t, context_state, 1, "rflags_slot");
+
+	return builder.CreateConstGEP2_32(session.state_t->getElementType(0), builder.CreateStructGEP(session.state_t, context_state, 0),
+		0, reg, Twine(context_names[reg]) + "_slot");
 }
 
-void vm_lifter::push_32(handler_t handler)
+llvm::Value* vm_lifter::read_context(v_context_t reg)
 {
-	vpush32(ConstantInt::get(builder.getInt32Ty(), *(uint32_t*)&handler.data));
+	return builder.CreateLoad(builder.getInt64Ty(), context_slot(reg), context_names[reg]);
+}
+
+void vm_lifter::write_context(v_context_t reg, llvm::Value* value)
+{
+	builder.CreateStore(builder.CreateZExtOrTrunc(value, builder.getInt64Ty()), context_slot(reg));
+
+	// native code sees the registers, so a vstack address placed in one has escaped like a guest store
+	if (is_vstack_derived(value))
+		mark_escaped();
+}
+
+void vm_lifter::vm_exit()
+{
+	builder.CreateRetVoid();
+}
+
+void vm_lifter::call(llvm::Value* target)
+{
+	Type* i64 = builder.getInt64Ty();
+	FunctionType* native_t = FunctionType::get(i64, { i64, i64, i64, i64 }, false);
+	llvm::Value* callee = builder.CreateIntToPtr(target, builder.getPtrTy(), "callee");
+
+	llvm::Value* arguments[] = { read_context(CTX_RCX), read_context(CTX_RDX), read_context(CTX_R8), read_context(CTX_R9) };
+	CallInst* result = builder.CreateCall(native_t, callee, arguments, "call_result");
+	result->setCallingConv(CallingConv::Win64);
+	write_context(CTX_RAX, result);
+
+	// a callee handed a vstack address may write through it, so the tracked slots are no longer reliable
+	for (llvm::Value* argument : arguments)
+	{
+		if (is_vstack_derived(argument))
+		{
+			mark_escaped();
+			vstack_slots.clear();
+			vstack_slots_complete = false;
+			break;
+		}
+	}
 }
 
 llvm::Value* vm_lifter::calc_zero_flag(llvm::Value* result)
@@ -241,103 +391,304 @@ llvm::Value* vm_lifter::calc_zero_flag(llvm::Value* result)
 	return builder.CreateSExt(cmp, builder.getInt64Ty(), "zf_ext");
 }
 
-void vm_lifter::sub_64(handler_t handler)
+
+std::optional<int64_t> vm_lifter::vstack_offset(llvm::Value* pointer)
 {
-	llvm::Value* first = vpop64();
-	llvm::Value* second = vpop64();
-	llvm::Value* result = builder.CreateSub(second, first, "sub_64_result");
+	APInt offset(64, 0);
+	llvm::Value* base = pointer->stripAndAccumulateConstantOffsets(module->getDataLayout(), offset, true);
+
+	if (base == vstack_memory)
+		return offset.getSExtValue();
 
-	vpush64(result);
-	vpush64(calc_zero_flag(result));
+	auto it = vsp_bases.find(base);
+	if (it != vsp_bases.end())
+		return it->second + offset.getSExtValue();
+
+	return std::nullopt;
 }
 
-void vm_lifter::sub_32(handler_t handler)
+std::optional<int64_t> vm_lifter::vstack_address(llvm::Value* value, int depth)
 {
-	llvm::Value* first = vpop32();
-	llvm::Value* second = vpop32();
-	llvm::Value* result = builder.CreateSub(second, first, "sub_32_result");
+	if (depth > 16)
+		return std::nullopt;
+
+	if (auto* ptr_to_int = dyn_cast<PtrToIntInst>(value))
+		return vstack_offset(ptr_to_int->getPointerOperand());
+
+	auto popped = popped_values.find(value);
+	if (popped != popped_values.end())
+		return popped->second ? vstack_address(popped->second, depth + 1) : std::nullopt;
 
-	vpush32(result);
-	vpush64(calc_zero_flag(result));
+	auto* binary_op = dyn_cast<BinaryOperator>(value);
+	if (!binary_op)
+		return std::nullopt;
+
+	auto* constant = dyn_cast<ConstantInt>(binary_op->getOperand(1));
+	if (!constant)
+		return std::nullopt;
+
+	auto base = vstack_address(binary_op->getOperand(0), depth + 1);
+	if (!base)
+		return std::nullopt;
+
+	if (binary_op->getOpcode() == Instruction::Add)
+		return *base + constant->getSExtValue();
+	if (binary_op->getOpcode() == Instruction::Sub)
+		return *base - constant->getSExtValue();
+
+	return std::nullopt;
 }
 
-void vm_lifter::add_64(handler_t handler)
+bool vm_lifter::is_vstack_derived(llvm::Value* value, int depth)
 {
-	llvm::Value* first = vpop64();
-	llvm::Value* second = vpop64();
-	llvm::Value* result = builder.CreateAdd(second, first, "add_64_result");
+	// anything we cannot follow is assumed to point into vstack_memory
+	if (depth > 16)
+		return true;
+
+	if (isa<Constant>(value) || isa<Argument>(value))
+		return false;
+
+	if (isa<PtrToIntInst>(value) || untracked_pops.contains(value))
+		return true;
 
-	vpush64(result);
-	vpush64(calc_zero_flag(result));
+	auto popped = popped_values.find(value);
+	if (popped != popped_values.end())
+		return popped->second && is_vstack_derived(popped->second, depth + 1);
+
+	auto* instruction = dyn_cast<Instruction>(value);
+	if (!instruction)
+		return true;
+
+	// guest memory only holds vstack addresses if one was written out
+	if (isa<LoadInst>(instruction))
+		return vstack_escaped;
+
+	for (llvm::Value* operand : instruction->operands())
+	{
+		if (is_vstack_derived(operand, depth + 1))
+			return true;
+	}
+	return false;
 }
 
-void vm_lifter::add_32()
+std::optional<uint64_t> vm_lifter::resolve_constant(llvm::Value* value, int depth)
 {
-	llvm::Value* first = vpop32();
-	llvm::Value* second = vpop32();
-	llvm::Value* result = builder.CreateAdd(second, first, "add_32_result");
+	if (depth > 16)
+		return std::nullopt;
+
+	unsigned bits = value->getType()->getIntegerBitWidth();
+	auto truncate = [bits](uint64_t result) { return bits >= 64 ? result : result & ((1ull << bits) - 1); };
+
+	if (auto* constant = dyn_cast<ConstantInt>(value))
+		return constant->getZExtValue();
+
+	auto popped = popped_values.find(value);
+	if (popped != popped_values.end())
+	{
+		if (!popped->second)
+			return std::nullopt;
+
+		auto result = resolve_constant(popped->second, depth + 1);
+		return result ? std::optional<uint64_t>(truncate(*result)) : std::nullopt;
+	}
+
+	auto* binary_op = dyn_cast<BinaryOperator>(value);
+	if (!binary_op)
+		return std::nullopt;
+
+	auto lhs = resolve_constant(binary_op->getOperand(0), depth + 1);
+	auto rhs = lhs ? resolve_constant(binary_op->getOperand(1), depth + 1) : std::nullopt;
+	if (!rhs)
+		return std::nullopt;
 
-	vpush32(result);
-	vpush64(calc_zero_flag(result));
+	switch (binary_op->getOpcode())
+	{
+	case Instruction::Add:
+		return truncate(*lhs + *rhs);
+	case Instruction::Sub:
+		return truncate(*lhs - *rhs);
+	case Instruction::Or:
+		return truncate(*lhs | *rhs);
+	case Instruction::And:
+		return truncate(*lhs & *rhs);
+	case Instruction::Xor:
+		return truncate(*lhs ^ *rhs);
+	default:
+		return std::nullopt;
+	}
 }
 
-void vm_lifter::write_32()
+std::optional<uint64_t> vm_lifter::fold_image_load(llvm::Value* address, int size)
 {
-	llvm::Value* address = vpop64();
-	llvm::Value* value = vpop32();
-	llvm::Value* pointer = builder.CreateIntToPtr(address, builder.getInt32Ty()->getPointerTo());
-	builder.CreateStore(value, pointer);
+	if (!session.image)
+		return std::nullopt;
+
+	auto va = resolve_constant(address);
+	if (!va)
+		return std::nullopt;
+
+	return session.image->read_constant(*va, size);
 }
 
-void vm_lifter::load_32()
+void vm_lifter::tag_vstack_access(llvm::Instruction* access)
 {
-	llvm::Value* address = vpop64();
-	llvm::Value* pointer = builder.CreateIntToPtr(address, builder.getInt32Ty()->getPointerTo());
-	llvm::Value* value = builder.CreateLoad(builder.getInt32Ty(), pointer);
-	vpush32(value);
+	if (vsp_in_guest)
+		return;
+
+	access->setMetadata(LLVMContext::MD_alias_scope, vstack_scope);
+	access->setMetadata(LLVMContext::MD_noalias, guest_scope);
 }
 
-void vm_lifter::load_64()
+void vm_lifter::tag_guest_access(llvm::Instruction* access, llvm::Value* address)
 {
-	llvm::Value* address = vpop64();
-	llvm::Value* pointer = builder.CreateIntToPtr(address, builder.getInt64Ty()->getPointerTo());
-	llvm::Value* value = builder.CreateLoad(builder.getInt64Ty(), pointer);
-	vpush64(value);
+	if (vstack_address(address) || is_vstack_derived(address))
+	{
+		access->setMetadata(LLVMContext::MD_alias_scope, vstack_scope);
+		access->setMetadata(LLVMContext::MD_noalias, guest_scope);
+		return;
+	}
+
+	access->setMetadata(LLVMContext::MD_alias_scope, guest_scope);
+	access->setMetadata(LLVMContext::MD_noalias, vstack_scope);
+	if (!vstack_escaped && !in_fragment)
+		early_guest_accesses.emplace_back(access, current_index);
 }
 
-void vm_lifter::or_32()
+void vm_lifter::mark_escaped()
 {
-	llvm::Value* first = vpop32();
-	llvm::Value* second = vpop32();
-	llvm::Value* result = builder.CreateOr(second, first, "or_32_result");
-
-	vpush32(result);
-	vpush64(calc_zero_flag(result));
+	if (!vstack_escaped && !in_fragment)
+		first_escape = current_index;
+	vstack_escaped = true;
 }
 
-void vm_lifter::and_32()
+void vm_lifter::untag_after_escape()
 {
-	llvm::Value* first = vpop32();
-	llvm::Value* second = vpop32();
-	llvm::Value* result = builder.CreateAnd(second, first, "and_32_result");
+	if (!first_escape)
+		return;
 
-	vpush32(result);
-	vpush64(calc_zero_flag(result));
+	// everything after the escape runs after it, and so does every loop a jnz from there can get back into
+	size_t reach = *first_escape;
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (size_t i = reach; i < handlers.size(); i++)
+		{
+			if (handlers[i].opcode != JNZ)
+				continue;
+
+			size_t target = resolve_target(handlers[i].data);
+			if (target < reach)
+			{
+				reach = target;
+				changed = true;
+			}
+		}
+	}
+
+	for (auto [access, index] : early_guest_accesses)
+	{
+		if (index < reach)
+			continue;
+
+		access->setMetadata(LLVMContext::MD_alias_scope, nullptr);
+		access->setMetadata(LLVMContext::MD_noalias, nullptr);
+	}
 }
 
-void vm_lifter::xor_32()
+void vm_lifter::on_vstack_store(llvm::StoreInst* store, llvm::Value* value)
 {
-	llvm::Value* first = vpop32();
-	llvm::Value* second = vpop32();
-	llvm::Value* result = builder.CreateXor(second, first, "xor_32_result");
+	tag_vstack_access(store);
 
-	vpush32(result);
-	vpush64(calc_zero_flag(result));
+	auto offset = vstack_offset(vsp);
+	if (!offset)
+		return;
+
+	int64_t size = module->getDataLayout().getTypeStoreSize(store->getValueOperand()->getType());
+	auto it = vstack_slots.lower_bound(*offset - 8);
+	while (it != vstack_slots.end() && it->first < *offset + size)
+	{
+		if (it->first + it->second.size > *offset)
+			it = vstack_slots.erase(it);
+		else
+			++it;
+	}
+	vstack_slots[*offset] = { value, size };
 }
 
-llvm::Value* vm_lifter::jnz()
+void vm_lifter::on_vstack_load(llvm::LoadInst* load)
 {
-	llvm::Value* zf = vpop64();
-	llvm::Value* condition = builder.CreateICmpNE(zf, builder.getInt64(0), "zf_cond");
-	return condition;
+	tag_vstack_access(load);
+
+	// vsp moved by an untracked amount, so the popped value may be anything
+	auto offset = vstack_offset(vsp);
+	if (!offset)
+	{
+		untracked_pops.insert(load);
+		return;
+	}
+
+	int64_t size = module->getDataLayout().getTypeStoreSize(load->getType());
+	auto exact = vstack_slots.find(*offset);
+	if (exact != vstack_slots.end() && exact->second.size == size)
+	{
+		popped_values[load] = exact->second.value;
+		return;
+	}
+
+	// a slot written before the tracking was forgotten may hold a vstack address or anything else
+	if (!vstack_slots_complete)
+	{
+		untracked_pops.insert(load);
+		return;
+	}
+
+	// partial reads only stay precise when none of the overlapped slots is vstack-derived
+	for (auto it = vstack_slots.lower_bound(*offset - 8); it != vstack_slots.end() && it->first < *offset + size; ++it)
+	{
+		if (it->first + it->second.size > *offset && is_vstack_derived(it->second.value))
+		{
+			untracked_pops.insert(load);
+			return;
+		}
+	}
+	popped_values[load] = nullptr;
 }
+llvm::PreservedAnalyses image_fold_pass::run(llvm::Function& function, llvm::FunctionAnalysisManager& FAM)
+{
+	const image_memory_t* image = session->image;
+	if (!image)
+		return llvm::PreservedAnalyses::all();
+
+	const DataLayout& layout = function.getParent()->getDataLayout();
+	bool changed = false;
+
+	for (BasicBlock& block : function)
+	{
+		for (Instruction& instruction : make_early_inc_range(block))
+		{
+			auto* load = dyn_cast<LoadInst>(&instruction);
+			if (!load || load->isVolatile() || !load->getType()->isIntegerTy())
+				continue;
+
+			APInt offset(64, 0);
+			auto* base = dyn_cast<ConstantExpr>(load->getPointerOperand()->stripAndAccumulateConstantOffsets(layout, offset, true));
+			if (!base || base->getOpcode() != Instruction::IntToPtr)
+				continue;
+
+			auto* address = dyn_cast<ConstantInt>(base->getOperand(0));
+			if (!address)
+				continue;
+
+			int size = layout.getTypeStoreSize(load->getType());
+			auto value = image->read_constant(address->getZExtValue() + offset.getSExtValue(), size);
+			if (!value)
+				continue;
+
+			load->replaceAllUsesWith(ConstantInt::get(load->getType(), *value));
+			load->eraseFromParent();
+			changed = true;
+		}
+	}
+
+	return changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
+}
\ No newline at end of file
@@ -1,16 +1,150 @@
 #pragma optimize("", on)
 #include <iostream>
+#include <thread>
+#include <sstream>
 #include "binary.hpp"
 #include "vm.hpp"
+#include "jit.hpp"
+#include "baseline.hpp"
+#include "tiered.hpp"
+#include "vtil_pipeline.hpp"
+#include "cache.hpp"
+#include "program_file.hpp"
+#include "daemon.hpp"
+#include "signature_db.hpp"
+#include "outliner.hpp"
+#include "recompiler.hpp"
+#include "benchmark.hpp"
+#include "decoder.hpp"
+#include "tests.hpp"
 
 using namespace llvm;
 
-#define IMAGE 0x140000000
-
-int main()
+int main(int argc, char** argv)
 {
 	std::string input_file = "input.exe";
 	uint64_t routine_va = 0x140017A41;
+	int jit_iterations = 0;
+	int lift_iterations = 0;
+	int tiered_iterations = 0;
+	int stage_iterations = 0;
+	std::string bench_json_path;
+	uint32_t tier_threshold = 64;
+	unsigned lift_threads = 1;
+	output_options_t output;
+	bool recompile = false;
+	bool print_handlers = false;
+	bool baseline_only = false;
+	std::vector<std::string> vtil_passes;
+	std::string cache_directory;
+	std::string program_path;
+	std::string save_program_path;
+	std::string daemon_socket;
+	unsigned daemon_workers = 0;
+	std::string signatures_path;
+	std::vector<uint64_t> image_routines;
+	outline_model_t outline_model;
+	double vtil_budget_ms = 0;
+	bool self_test = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--jit-bench" && i + 1 < argc)
+			jit_iterations = std::stoi(argv[++i]);
+		else if (arg == "--lift-bench" && i + 1 < argc)
+			lift_iterations = std::stoi(argv[++i]);
+		else if (arg == "--tiered-bench" && i + 1 < argc)
+			tiered_iterations = std::stoi(argv[++i]);
+		else if (arg == "--stage-bench" && i + 1 < argc)
+			stage_iterations = std::stoi(argv[++i]);
+		else if (arg == "--bench-json" && i + 1 < argc)
+			bench_json_path = argv[++i];
+		else if (arg == "--tier-threshold" && i + 1 < argc)
+			tier_threshold = std::stoul(argv[++i]);
+		else if (arg == "--lift-threads" && i + 1 < argc)
+			lift_threads = std::stoi(argv[++i]);
+		else if (arg == "--dump")
+			output.dump = true;
+		else if (arg == "--emit-ll")
+			output.emit_text = true;
+		else if (arg == "--stats")
+			output.stats = true;
+		else if (arg == "--no-bc")
+			output.emit_bitcode = false;
+		else if (arg == "--vtil-compact")
+			output.vtil_compact = true;
+		else if (arg == "--recompile")
+			recompile = true;
+		else if (arg == "--print")
+			print_handlers = true;
+		else if (arg == "--baseline")
+			baseline_only = true;
+		else if (arg == "--self-test")
+			self_test = true;
+		else if (arg == "--cache" && i + 1 < argc)
+			cache_directory = argv[++i];
+		else if (arg == "--daemon" && i + 1 < argc)
+			daemon_socket = argv[++i];
+		else if (arg == "--daemon-workers" && i + 1 < argc)
+			daemon_workers = std::stoi(argv[++i]);
+		else if (arg == "--routines" && i + 1 < argc)
+		{
+			std::stringstream list(argv[++i]);
+			for (std::string va; std::getline(list, va, ','); )
+				image_routines.push_back(std::stoull(va, nullptr, 16));
+		}
+		else if (arg == "--outline-min" && i + 1 < argc)
+			outline_model.min_instructions = std::stoul(argv[++i]);
+		else if (arg == "--signatures" && i + 1 < argc)
+			signatures_path = argv[++i];
+		else if (arg == "--program" && i + 1 < argc)
+			program_path = argv[++i];
+		else if (arg == "--save-program" && i + 1 < argc)
+			save_program_path = argv[++i];
+		else if (arg == "--vtil-budget" && i + 1 < argc)
+			vtil_budget_ms = std::stod(argv[++i]);
+		else if (arg == "--vtil-passes" && i + 1 < argc)
+		{
+			std::stringstream list(argv[++i]);
+			for (std::string name; std::getline(list, name, ','); )
+			{
+				if (!vtil_pipeline::find(name))
+				{
+					std::cerr << "[!] Unknown VTIL pass " << name << ", available:";
+					for (const vtil_pipeline::pass_t& pass : vtil_pipeline::available())
+						std::cerr << " " << pass.name;
+					std::cerr << std::endl;
+					return -1;
+				}
+				vtil_passes.push_back(name);
+			}
+		}
+	}
+
+	// synthetic input only, no image is loaded
+	if (self_test)
+		return run_self_tests() ? -1 : 0;
+
+	std::unique_ptr<signature_db> signatures;
+	if (!signatures_path.empty())
+	{
+		signatures = signature_db::open(signatures_path);
+		if (!signatures)
+			return -1;
+	}
+
+	// every request names its own image, nothing below runs in daemon mode
+	if (!daemon_socket.empty())
+	{
+		vm_daemon daemon(daemon_socket, daemon_workers ? daemon_workers : std::max(std::thread::hardware_concurrency(), 1u));
+		daemon.signatures = signatures.get();
+		return daemon.run();
+	}
+
+	// loads and decodes the input on its own for every stage it measures
+	if (stage_iterations > 0)
+		return benchmark_stages(input_file, routine_va, stage_iterations, bench_json_path);
 
 	std::unique_ptr<LIEF::PE::Binary> binary = LIEF::PE::Parser::parse(input_file);
 	if (!binary) {
@@ -18,77 +152,154 @@ int main()
 		return -1;
 	}
 
-	auto routine_content = binary->get_content_from_virtual_address(routine_va, 10);
-	auto vm_entry_disassembly = disassemble(routine_content, routine_va, ZYDIS_MNEMONIC_JMP);
+	image_memory_t image(*binary);
+
+	// a mapped program replaces decoding, the image is still needed for folding and execution
+	std::unique_ptr<program_file> mapped;
+	if (!program_path.empty())
+	{
+		mapped = program_file::map(program_path);
+		if (!mapped)
+			return -1;
+
+		const program_header_t& info = mapped->info();
+		if (info.image_base != image.image_base)
+			std::cerr << "[!] " << program_path << " was decoded from an image based at 0x" << std::hex << info.image_base << std::dec << std::endl;
+
+		routine_va = info.routine_va;
+		outs() << "[+] mapped " << info.handler_count << " handlers, " << info.block_count << " blocks, " << mapped->edges().size() << " edges\n";
+	}
+
+	// a hit skips decoding, lifting and O3, only the outputs are produced again
+	std::optional<artifact_cache> cache;
+	std::string cache_key;
+	std::string cached_bitcode;
+	bool cache_hit = false;
+	if (!cache_directory.empty())
+	{
+		cache.emplace(cache_directory);
+		cache_key = artifact_cache::key(image, routine_va, "O3");
+	}
+
+	std::vector<handler_t> decoded;
+	if (cache && !mapped)
+		cache_hit = cache->load(cache_key, decoded, cached_bitcode);
+
+	vm_decoder decoder(*binary, image, signatures.get());
 
-	if (vm_entry_disassembly[0].i.mnemonic != ZYDIS_MNEMONIC_PUSH || vm_entry_disassembly[0].operands[0].type != ZYDIS_OPERAND_TYPE_IMMEDIATE ||
-		vm_entry_disassembly[1].i.mnemonic != ZYDIS_MNEMONIC_JMP || vm_entry_disassembly[1].operands[0].type != ZYDIS_OPERAND_TYPE_IMMEDIATE ||
-		vm_entry_disassembly[1].operands[0].imm.is_relative == false)
+	// whole image: every routine in one module, with the blocks they share outlined
+	if (!image_routines.empty())
+		return devirtualize_image(image, decoder, image_routines, outline_model);
+
+	std::string decode_error;
+	if (!mapped && !cache_hit && !decoder.decode(routine_va, decoded, decode_error))
 	{
+		std::cerr << "[!] Cannot decode the routine: " << decode_error << std::endl;
 		return -1;
 	}
 
-	uint64_t virtual_instr_address = vm_entry_disassembly[0].operands[0].imm.value.u;
-	auto virtual_instr_content = binary->get_content_from_virtual_address(IMAGE + virtual_instr_address, 100000);
+	if (signatures)
+		signatures->report(outs());
 
-	std::vector<handler_t> handlers;
-	int unique_handler_count = 1;
-	int handler_count = 1;
+	vm_program handlers = mapped ? mapped->program() : vm_program(decoded);
+	if (!save_program_path.empty() && !program_file::write(save_program_path, handlers, image.image_base, routine_va))
+		std::cerr << "[!] Failed to write the program to " << save_program_path << std::endl;
 
-	// extract handlers from vm
-	for (int i = 0; i < virtual_instr_content.size();)
+	if (print_handlers)
 	{
-		handler_t handler = {};
+		for (const handler_t& handler : handlers)
+			utils::print_handler(std::cout, handler);
+	}
 
-		if (i == 0)
+	// the in-process image is not bound by a loader, so routines that call out cannot be executed
+	bool calls_out = std::any_of(handlers.begin(), handlers.end(), [](const handler_t& handler) {
+		return handler.opcode == CALL_NATIVE || handler.opcode == CALL_IMPORT;
+	});
+
+	// triage: native code in microseconds, no llvm module at all
+	if (baseline_only)
+	{
+		vm_baseline baseline(handlers);
+		if (!baseline.compile())
 		{
-			handler.next_handler = *(uint32_t*)&virtual_instr_content[i];
-			handler.instr_size = 4;
-			handler.opcode = VM_INIT;
-			handlers.push_back(handler);
-
-			i += handler.instr_size;
-			//std::cout << "handler " << std::dec << unique_handler_count << " at 0x" << std::hex << IMAGE + handler.next_handler << std::endl;
-			unique_handler_count++;
-			handler_count++;
-			continue;
+			std::cerr << "[!] Failed to compile with the baseline compiler!" << std::endl;
+			return -1;
 		}
+		outs() << "[+] baseline compile: " << baseline.compile_us << " us, " << baseline.code_size() << " bytes\n";
+		return 0;
+	}
 
-		uint64_t handler_address = IMAGE + handlers[handlers.size() - 1].next_handler;
-		auto handler_content = disassemble(binary->get_content_from_virtual_address(handler_address, 50), handler_address, ZYDIS_MNEMONIC_JMP);
-		handler = utils::analyze_handler(handler_content);
+	// value names only matter when the IR is read by a human
+	lift_session session;
+	session.context.setDiscardValueNames(!output.dump && !output.emit_text);
+	session.image = &image;
 
-		handler.address = virtual_instr_address + i;
-		if (i + handler.instr_size >= virtual_instr_content.size() || handler.instr_size < 4)
-			break;
+	if (lift_iterations > 0)
+	{
+		guest_memory_t guest(image);
+		benchmark_lifting(session, handlers, lift_iterations, guest.mapped() && !calls_out);
+	}
 
-		memcpy(&handler.data, &virtual_instr_content[i], handler.instr_size - 4);
-		memcpy(&handler.next_handler, &virtual_instr_content[i + handler.instr_size - 4], 4);
+	vm_lifter lifter(session, handlers);
+	lifter.output = output;
+	lifter.threads = lift_threads ? lift_threads : std::max(std::thread::hardware_concurrency(), 1u);
+	lifter.vtil_passes = vtil_passes;
+	lifter.vtil_budget_ms = vtil_budget_ms;
+	lifter.fragment_cache = cache ? &*cache : nullptr;
 
-		bool is_handler_unique = true;
-		for (auto& tmp_handler : handlers)
-		{
-			if (handler.next_handler == tmp_handler.next_handler)
-			{
-				is_handler_unique = false;
-				break;
-			}
-		}
+	// the backends only share the read-only handlers, vtil runs next to the llvm pipeline
+	utils::stopwatch_t lift_timer;
+	std::thread vtil_thread([&] { lifter.liftToVTIL(); });
+	bool lifted = true;
+	if (!cache_hit || !lifter.loadLLVM(cached_bitcode))
+	{
+		lifted = lifter.liftToLLVM();
+		if (lifted && cache && !cache->store(cache_key, handlers, *lifter.module))
+			std::cerr << "[!] Failed to store the routine in the cache" << std::endl;
+	}
+	vtil_thread.join();
+	if (!lifted)
+		return -1;
+	if (output.stats || !vtil_passes.empty() || vtil_budget_ms > 0)
+		outs() << lifter.vtil_report;
+
+	if (cache)
+		cache->report(outs());
+	if (output.stats)
+		outs() << "; llvm and vtil done in " << lift_timer.elapsed_ms() << " ms\n";
 
-		if (is_handler_unique)
+	if (output.dump)
+		lifter.dumpVTIL();
+
+	if (jit_iterations > 0)
+	{
+		guest_memory_t guest(image);
+		if (calls_out)
+			std::cerr << "[!] Skipping the execution benchmark, the routine calls out to native code" << std::endl;
+		else if (guest.mapped())
 		{
-			//std::cout << "handler " << std::dec << unique_handler_count << " at 0x" << std::hex << IMAGE + handler.next_handler << std::endl;
-			unique_handler_count++;
+			benchmark_execution(handlers, *lifter.module, jit_iterations);
+			benchmark_baseline(handlers, jit_iterations);
 		}
-
-		handler_count++;
-		i += handler.instr_size;
-		handlers.push_back(handler);
 	}
 
-	llvm::LLVMContext context;
-	vm_lifter lifter(context, handlers);
+	if (tiered_iterations > 0)
+	{
+		guest_memory_t guest(image);
+		if (calls_out)
+			std::cerr << "[!] Skipping the tiered benchmark, the routine calls out to native code" << std::endl;
+		else if (guest.mapped())
+			benchmark_tiered(image, handlers, tiered_iterations, tier_threshold);
+	}
 
-	lifter.liftToLLVM();
-	lifter.liftToVTIL();
+	if (recompile)
+	{
+		recompiler_t recompiler;
+		std::vector<uint8_t> code;
+		if (!recompiler.compile(*lifter.module, code) || !recompiler.patch(*binary, routine_va, code, "output.exe"))
+		{
+			std::cerr << "[!] Failed to recompile!" << std::endl;
+			return -1;
+		}
+	}
 }
\ No newline at end of file
@@ -0,0 +1,287 @@
+#include "outliner.hpp"
+#include "decoder.hpp"
+#include "recompiler.hpp"
+
+#include <set>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Transforms/IPO/MergeFunctions.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/CodeExtractor.h>
+
+namespace
+{
+	struct candidate_t
+	{
+		BasicBlock* block;
+		size_t size;
+		size_t inputs;
+		size_t outputs;
+	};
+
+	// the straight-line part of a block with what makes two of them interchangeable: opcodes, types, flags and
+	// constants, operands named by the instruction that defines them or by their first use when they come from
+	// outside, and which results are still used after it. blocks with the same key extract to the same function
+	std::optional<candidate_t> describe_block(BasicBlock& block, std::vector<uint64_t>& key)
+	{
+		BasicBlock::iterator first = block.getFirstNonPHI()->getIterator();
+		BasicBlock::iterator last = block.getTerminator()->getIterator();
+
+		DenseMap<const Value*, uint64_t> locals;
+		for (Instruction& instruction : make_range(first, last))
+		{
+			if (isa<AllocaInst>(instruction) || instruction.isEHPad())
+				return std::nullopt;
+			locals.try_emplace(&instruction, locals.size());
+		}
+
+		candidate_t candidate = { &block, 0, 0, 0 };
+		DenseMap<const Value*, uint64_t> inputs;
+		for (Instruction& instruction : make_range(first, last))
+		{
+			if (instruction.isDebugOrPseudoInst())
+				continue;
+			candidate.size++;
+
+			key.push_back(instruction.getOpcode());
+			key.push_back((uint64_t)instruction.getType());
+			key.push_back(instruction.getRawSubclassOptionalData());
+			if (auto* compare = dyn_cast<CmpInst>(&instruction))
+				key.push_back(compare->getPredicate());
+			else if (auto* load = dyn_cast<LoadInst>(&instruction))
+				key.push_back((load->getAlign().value() << 1) | load->isVolatile());
+			else if (auto* store = dyn_cast<StoreInst>(&instruction))
+				key.push_back((store->getAlign().value() << 1) | store->isVolatile());
+			else if (auto* gep = dyn_cast<GetElementPtrInst>(&instruction))
+				key.push_back((uint64_t)gep->getSourceElementType());
+			else if (auto* call = dyn_cast<CallBase>(&instruction))
+				key.push_back(call->getCallingConv());
+
+			for (const Use& use : instruction.operands())
+			{
+				const Value* value = use.get();
+				if (auto it = locals.find(value); it != locals.end())
+				{
+					key.push_back(1);
+					key.push_back(it->second);
+				}
+				else if (isa<Constant>(value))
+				{
+					key.push_back(2);
+					key.push_back((uint64_t)value);
+				}
+				else
+				{
+					auto [it, inserted] = inputs.try_emplace(value, inputs.size());
+					key.push_back(3);
+					key.push_back(it->second);
+					key.push_back((uint64_t)value->getType());
+				}
+			}
+
+			bool escapes = std::any_of(instruction.user_begin(), instruction.user_end(), [&](const User* user) {
+				return !locals.count(user);
+			});
+			key.push_back(escapes);
+			candidate.outputs += escapes;
+		}
+
+		candidate.inputs = inputs.size();
+		return candidate;
+	}
+}
+
+outline_stats_t block_outliner::run(Module& module)
+{
+	outline_stats_t stats;
+	stats.instructions_before = utils::count_instructions(module);
+
+	// group identical blocks in the order they are first seen, so the output does not depend on pointer values
+	std::vector<candidate_t> candidates;
+	std::vector<std::vector<size_t>> groups;
+	std::map<std::vector<uint64_t>, size_t> group_of;
+	for (Function& function : module)
+	{
+		for (BasicBlock& block : function)
+		{
+			std::vector<uint64_t> key;
+			std::optional<candidate_t> candidate = describe_block(block, key);
+			if (!candidate || candidate->size < model.min_instructions)
+				continue;
+
+			auto [it, inserted] = group_of.try_emplace(std::move(key), groups.size());
+			if (inserted)
+				groups.emplace_back();
+			groups[it->second].push_back(candidates.size());
+			candidates.push_back(*candidate);
+			stats.candidates++;
+		}
+	}
+
+	// only the body moves out, phis and the terminator stay so every copy leaves through one edge
+	std::map<Function*, std::vector<BasicBlock*>> bodies;
+	for (const std::vector<size_t>& group : groups)
+	{
+		const candidate_t& first = candidates[group.front()];
+		if (group.size() < 2 || model.benefit(group.size(), first.size, first.inputs, first.outputs) <= 0)
+			continue;
+
+		stats.groups++;
+		for (size_t index : group)
+		{
+			BasicBlock* block = candidates[index].block;
+			Instruction* body_start = block->getFirstNonPHI();
+			BasicBlock* body = body_start == &block->front() && !block->isEntryBlock() ? block : block->splitBasicBlock(body_start);
+			body->splitBasicBlock(body->getTerminator());
+			bodies[block->getParent()].push_back(body);
+		}
+	}
+
+	std::set<std::string> outlined;
+	for (auto& [function, blocks] : bodies)
+	{
+		CodeExtractorAnalysisCache cache(*function);
+		for (BasicBlock* body : blocks)
+		{
+			CodeExtractor extractor(ArrayRef<BasicBlock*>(body), nullptr, false, nullptr, nullptr, nullptr, false, false, nullptr, "outlined");
+			if (!extractor.isEligible())
+				continue;
+
+			Function* extracted = extractor.extractCodeRegion(cache);
+			if (!extracted)
+				continue;
+
+			extracted->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+			outlined.insert(extracted->getName().str());
+			stats.extracted++;
+		}
+	}
+
+	// identical extractions become one function, every caller is pointed at the survivor
+	{
+		LoopAnalysisManager LAM;
+		FunctionAnalysisManager FAM;
+		CGSCCAnalysisManager CGAM;
+		ModuleAnalysisManager MAM;
+		PassBuilder PB;
+		PB.registerModuleAnalyses(MAM);
+		PB.registerCGSCCAnalyses(CGAM);
+		PB.registerFunctionAnalyses(FAM);
+		PB.registerLoopAnalyses(LAM);
+		PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+		ModulePassManager MPM;
+		MPM.addPass(MergeFunctionsPass());
+		MPM.run(module, MAM);
+	}
+
+	for (Function& function : make_early_inc_range(module))
+	{
+		if (!outlined.count(function.getName().str()))
+			continue;
+
+		if (function.hasOneUse())
+		{
+			if (auto* call = dyn_cast<CallInst>(function.user_back()))
+			{
+				InlineFunctionInfo info;
+				if (InlineFunction(*call, info).isSuccess())
+				{
+					function.eraseFromParent();
+					stats.inlined_back++;
+					continue;
+				}
+			}
+		}
+
+		if (function.use_empty())
+			function.eraseFromParent();
+		else
+			stats.shared++;
+	}
+
+	// the splits left unconditional branches behind
+	for (Function& function : module)
+	{
+		for (BasicBlock& block : make_early_inc_range(function))
+			MergeBlockIntoPredecessor(&block);
+	}
+
+	stats.instructions_after = utils::count_instructions(module);
+	return stats;
+}
+
+int devirtualize_image(const image_memory_t& image, vm_decoder& decoder, const std::vector<uint64_t>& routines, const outline_model_t& model)
+{
+	lift_session session;
+	session.context.setDiscardValueNames(true);
+	session.image = &image;
+
+	std::unique_ptr<Module> combined = session.create_module();
+	Linker linker(*combined);
+	size_t lifted = 0;
+	for (uint64_t routine_va : routines)
+	{
+		std::vector<handler_t> handlers;
+		std::string error;
+		if (!decoder.decode(routine_va, handlers, error))
+		{
+			std::cerr << "[!] Skipping 0x" << std::hex << routine_va << std::dec << ": " << error << std::endl;
+			continue;
+		}
+
+		vm_lifter lifter(session, handlers);
+		lifter.lift();
+		lifter.optimizeLLVM(OptimizationLevel::O3);
+		lifter.function->setName("devirtualized_" + utohexstr(routine_va, true));
+		if (linker.linkInModule(std::move(lifter.module)))
+		{
+			errs() << "Error linking the routine at 0x" << utohexstr(routine_va, true) << "\n";
+			return -1;
+		}
+		lifted++;
+	}
+
+	if (lifted == 0)
+		return -1;
+
+	recompiler_t recompiler;
+	size_t size_before = recompiler.emitted_size(*combined);
+
+	utils::stopwatch_t outline_timer;
+	block_outliner outliner(model);
+	outline_stats_t stats = outliner.run(*combined);
+	double outline_ms = outline_timer.elapsed_ms();
+
+	if (verifyModule(*combined, &errs()))
+	{
+		errs() << "Error: the outlined module does not verify\n";
+		return -1;
+	}
+
+	size_t size_after = recompiler.emitted_size(*combined);
+
+	// every routine runs once, so the footprint is every line of code the image was recompiled to
+	auto lines = [](size_t bytes) { return (bytes + 63) / 64; };
+	outs() << "; " << lifted << " routines, " << stats.candidates << " candidate blocks, " << stats.groups << " duplicate groups, "
+		<< stats.extracted << " extracted into " << stats.shared << " shared functions, " << stats.inlined_back << " inlined back in "
+		<< format("%.2f", outline_ms) << " ms\n";
+	outs() << "; ir: " << stats.instructions_before << " -> " << stats.instructions_after << " instructions\n";
+	if (size_before && size_after)
+	{
+		outs() << "; recompiled code: " << size_before << " -> " << size_after << " bytes ("
+			<< format("%.1f", 100.0 * ((double)size_after - (double)size_before) / (double)size_before) << "%), i-cache footprint: "
+			<< lines(size_before) << " -> " << lines(size_after) << " 64-byte lines\n";
+	}
+
+	std::error_code error;
+	raw_fd_ostream stream("output_image.bc", error, sys::fs::OF_None);
+	if (error)
+	{
+		errs() << "Error opening file: " << error.message() << "\n";
+		return -1;
+	}
+	WriteBitcodeToFile(*combined, stream);
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "vm.hpp"
+
+class vm_decoder;
+
+// size model in ir instructions: a group of identical blocks is outlined when what the copies save beats the calls
+// that replace them and the shared function's own prologue and return
+struct outline_model_t
+{
+	size_t min_instructions = 6;
+	size_t call_cost = 2;			// the call itself and the stack adjustment around it
+	size_t argument_cost = 1;		// per input moved into an argument register
+	size_t output_cost = 2;			// per value written back through a pointer and reloaded
+	size_t function_cost = 3;
+
+	int64_t benefit(size_t copies, size_t size, size_t inputs, size_t outputs) const
+	{
+		int64_t per_call = call_cost + inputs * argument_cost + outputs * output_cost;
+		return (int64_t)((copies - 1) * size) - (int64_t)copies * per_call - (int64_t)function_cost;
+	}
+};
+
+struct outline_stats_t
+{
+	size_t candidates = 0;		// blocks long enough to be considered
+	size_t groups = 0;			// sets of at least two identical blocks the model accepted
+	size_t extracted = 0;
+	size_t shared = 0;			// outlined functions left after merging, each called from several places
+	size_t inlined_back = 0;	// extractions that did not merge with anything
+	size_t instructions_before = 0;
+	size_t instructions_after = 0;
+};
+
+// whole-module pass over already optimized code: the straight-line part of every basic block (after the phis,
+// before the terminator) is hashed over its opcodes, types, constants and the shape of its def-use edges, identical
+// ones across all functions are split out with CodeExtractor, MergeFunctions folds the copies into one, and an
+// extraction that stayed alone is inlined back
+class block_outliner
+{
+public:
+	block_outliner(outline_model_t model_ = {}) : model(model_) {}
+
+	outline_stats_t run(llvm::Module& module);
+
+private:
+	outline_model_t model;
+};
+
+// lifts every routine into one module at O3, outlines the blocks they share, reports the recompiled code size and
+// i-cache footprint before and after, and writes output_image.bc
+int devirtualize_image(const image_memory_t& image, vm_decoder& decoder, const std::vector<uint64_t>& routines, const outline_model_t& model);
@@ -0,0 +1,243 @@
+#include "program_file.hpp"
+
+#include <fstream>
+#include <unordered_set>
+
+// what an operand is stored relative to, address operands become small deltas to the handler itself
+static uint64_t operand_base(v_opcode_t opcode, uint32_t address, uint64_t image_base)
+{
+	switch (opcode)
+	{
+	case VM_INIT:
+	case JNZ:
+		return address;
+	case CALL_NATIVE:
+	case CALL_IMPORT:
+		return image_base + address;
+	default:
+		return 0;
+	}
+}
+
+// next_handler is not stored, only the decoder follows it
+handler_t vm_program::load_column(size_t index) const
+{
+	handler_t handler = {};
+	handler.opcode = (v_opcode_t)columns->opcodes[index];
+	handler.instr_size = columns->sizes[index];
+	handler.address = columns->addresses[index];
+
+	int64_t delta = columns->operands[index];
+	if (delta == wide_operand)
+	{
+		// program_file::map checked that every escaped operand has its entry
+		auto it = std::lower_bound(columns->wide.begin(), columns->wide.end(), index, [](const program_wide_t& wide, size_t index) {
+			return wide.index < index;
+		});
+		delta = it != columns->wide.end() && it->index == index ? it->delta : 0;
+	}
+
+	handler.data = operand_base(handler.opcode, handler.address, columns->image_base) + (uint64_t)delta;
+	return handler;
+}
+
+bool program_file::write(const std::string& path, const vm_program& handlers, uint64_t image_base, uint64_t routine_va)
+{
+	size_t count = handlers.size();
+	std::vector<uint8_t> opcodes(count), sizes(count);
+	std::vector<uint32_t> addresses(count);
+	std::vector<int32_t> operands(count);
+	std::vector<program_wide_t> wide;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		handler_t handler = handlers[i];
+		opcodes[i] = (uint8_t)handler.opcode;
+		sizes[i] = (uint8_t)handler.instr_size;
+		addresses[i] = handler.address;
+
+		int64_t delta = (int64_t)(handler.data - operand_base(handler.opcode, handler.address, image_base));
+		if (delta > INT32_MIN && delta <= INT32_MAX)
+			operands[i] = (int32_t)delta;
+		else
+		{
+			operands[i] = wide_operand;
+			wide.push_back({ (uint32_t)i, 0, delta });
+		}
+	}
+
+	std::vector<vm_block_t> split = split_blocks(handlers);
+	std::vector<size_t> block_at(count + 1, split.size());
+	std::unordered_map<uint32_t, size_t> block_at_address;
+	for (size_t i = 0; i < split.size(); i++)
+	{
+		block_at[split[i].first] = i;
+		block_at_address.emplace(handlers[split[i].first].address, i);
+	}
+
+	std::vector<program_block_t> blocks;
+	std::vector<program_edge_t> edges;
+	for (size_t i = 0; i < split.size(); i++)
+	{
+		const vm_block_t& block = split[i];
+		blocks.push_back({ (uint32_t)block.first, (uint32_t)block.last, block.entry_height.value_or(INT64_MIN) });
+
+		handler_t last = handlers[block.last - 1];
+		if (last.opcode == JNZ)
+			edges.push_back({ (uint32_t)i, (uint32_t)block_at_address.at((uint32_t)last.data) });
+		edges.push_back({ (uint32_t)i, (uint32_t)block_at[block.last] });
+	}
+
+	std::string content(sizeof(program_header_t), '\0');
+	auto column = [&](const void* data, size_t size) {
+		content.resize((content.size() + 7) & ~(size_t)7);
+		uint64_t offset = content.size();
+		content.append((const char*)data, size);
+		return offset;
+	};
+
+	program_header_t header = {};
+	header.magic = program_magic;
+	header.version = program_version;
+	header.header_size = sizeof(program_header_t);
+	header.image_base = image_base;
+	header.routine_va = routine_va;
+	header.handler_count = (uint32_t)count;
+	header.wide_count = (uint32_t)wide.size();
+	header.block_count = (uint32_t)blocks.size();
+	header.edge_count = (uint32_t)edges.size();
+	header.opcodes_offset = column(opcodes.data(), opcodes.size());
+	header.sizes_offset = column(sizes.data(), sizes.size());
+	header.addresses_offset = column(addresses.data(), addresses.size() * sizeof(uint32_t));
+	header.operands_offset = column(operands.data(), operands.size() * sizeof(int32_t));
+	header.wide_offset = column(wide.data(), wide.size() * sizeof(program_wide_t));
+	header.blocks_offset = column(blocks.data(), blocks.size() * sizeof(program_block_t));
+	header.edges_offset = column(edges.data(), edges.size() * sizeof(program_edge_t));
+	header.file_size = content.size();
+	memcpy(content.data(), &header, sizeof(header));
+
+	std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+	stream.write(content.data(), content.size());
+	return (bool)stream;
+}
+
+std::unique_ptr<program_file> program_file::map(const std::string& path)
+{
+	uint64_t file_size = 0;
+	if (std::error_code error = sys::fs::file_size(path, file_size))
+	{
+		errs() << "Error opening " << path << ": " << error.message() << "\n";
+		return nullptr;
+	}
+
+	if (file_size < sizeof(program_header_t))
+	{
+		errs() << "Error mapping " << path << ": not a decoded program\n";
+		return nullptr;
+	}
+
+	Expected<sys::fs::file_t> file = sys::fs::openNativeFileForRead(path);
+	if (!file)
+	{
+		errs() << "Error opening " << path << ": " << toString(file.takeError()) << "\n";
+		return nullptr;
+	}
+
+	auto result = std::make_unique<program_file>();
+	std::error_code error;
+	result->region = sys::fs::mapped_file_region(*file, sys::fs::mapped_file_region::readonly, file_size, 0, error);
+	sys::fs::closeFile(*file);
+	if (error)
+	{
+		errs() << "Error mapping " << path << ": " << error.message() << "\n";
+		return nullptr;
+	}
+
+	const char* base = result->region.const_data();
+	const program_header_t* header = (const program_header_t*)base;
+	if (header->magic != program_magic || header->version != program_version || header->header_size != sizeof(program_header_t) || header->file_size != file_size)
+	{
+		errs() << "Error mapping " << path << ": not a version " << program_version << " decoded program\n";
+		return nullptr;
+	}
+
+	// the columns are used in place, so only their bounds and alignment are checked
+	auto fits = [&](uint64_t offset, uint64_t count, size_t size) {
+		return offset % 8 == 0 && offset <= file_size && count * size <= file_size - offset;
+	};
+	if (!fits(header->opcodes_offset, header->handler_count, 1) || !fits(header->sizes_offset, header->handler_count, 1) ||
+		!fits(header->addresses_offset, header->handler_count, sizeof(uint32_t)) || !fits(header->operands_offset, header->handler_count, sizeof(int32_t)) ||
+		!fits(header->wide_offset, header->wide_count, sizeof(program_wide_t)) || !fits(header->blocks_offset, header->block_count, sizeof(program_block_t)) ||
+		!fits(header->edges_offset, header->edge_count, sizeof(program_edge_t)))
+	{
+		errs() << "Error mapping " << path << ": a column is out of the file\n";
+		return nullptr;
+	}
+
+	// everything below is read without further checks: split_blocks and the lifters index handlers by the blocks,
+	// load_column looks escaped operands up in the wide column, and jnz targets are resolved by address
+	auto reject = [&](const char* reason) {
+		errs() << "Error mapping " << path << ": " << reason << "\n";
+		return nullptr;
+	};
+
+	const uint8_t* opcodes = (const uint8_t*)(base + header->opcodes_offset);
+	const int32_t* operands = (const int32_t*)(base + header->operands_offset);
+	const program_wide_t* wide = (const program_wide_t*)(base + header->wide_offset);
+	size_t wide_used = 0;
+	for (uint32_t i = 0; i < header->handler_count; i++)
+	{
+		if (opcodes[i] >= OPCODE_COUNT)
+			return reject("a handler has an unknown opcode");
+
+		if (operands[i] == wide_operand)
+		{
+			if (wide_used == header->wide_count || wide[wide_used].index != i)
+				return reject("an escaped operand has no wide entry");
+			wide_used++;
+		}
+	}
+	if (wide_used != header->wide_count)
+		return reject("the wide column is not sorted or has entries nothing refers to");
+
+	const program_edge_t* edges = (const program_edge_t*)(base + header->edges_offset);
+	for (uint32_t i = 0; i < header->edge_count; i++)
+	{
+		if (edges[i].from >= header->block_count || edges[i].to > header->block_count)
+			return reject("an edge names a block that does not exist");
+	}
+
+	result->header = header;
+	result->columns.image_base = header->image_base;
+	result->columns.opcodes = (const uint8_t*)(base + header->opcodes_offset);
+	result->columns.sizes = (const uint8_t*)(base + header->sizes_offset);
+	result->columns.addresses = (const uint32_t*)(base + header->addresses_offset);
+	result->columns.operands = (const int32_t*)(base + header->operands_offset);
+	result->columns.wide = ArrayRef<program_wide_t>((const program_wide_t*)(base + header->wide_offset), header->wide_count);
+	result->columns.blocks = ArrayRef<program_block_t>((const program_block_t*)(base + header->blocks_offset), header->block_count);
+	result->cfg = ArrayRef<program_edge_t>((const program_edge_t*)(base + header->edges_offset), header->edge_count);
+
+	std::unordered_set<uint32_t> addresses;
+	for (const handler_t& handler : result->program())
+		addresses.insert(handler.address);
+	for (const handler_t& handler : result->program())
+	{
+		if (handler.opcode == JNZ && !addresses.count((uint32_t)handler.data))
+			return reject("a jnz targets no handler");
+	}
+
+	// the lifters take blocks and entry heights from the table, so it has to be exactly what split_blocks gives for
+	// these handlers: every jnz ends a block, every target starts one and the heights are the ones the code expects
+	vm_program program = result->program();
+	std::vector<handler_t> decoded(program.begin(), program.end());
+	std::vector<vm_block_t> split = split_blocks(decoded);
+	if (split.size() != result->columns.blocks.size())
+		return reject("the block table does not match the handlers");
+	for (size_t i = 0; i < split.size(); i++)
+	{
+		const program_block_t& stored = result->columns.blocks[i];
+		if (stored.first != split[i].first || stored.last != split[i].last || stored.entry_height != split[i].entry_height.value_or(INT64_MIN))
+			return reject("the block table does not match the handlers");
+	}
+	return result;
+}
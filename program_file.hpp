@@ -0,0 +1,94 @@
+#pragma once
+#include "vm.hpp"
+
+#include <llvm/Support/FileSystem.h>
+
+// decoded programs on disk: a header and fixed width columns, so a mapped file is read in place with no parsing.
+// every column starts 8 byte aligned, everything is little endian
+//
+//   header    program_header_t
+//   opcodes   u8 per handler
+//   sizes     u8 per handler, instr_size
+//   addresses u32 per handler, bytecode rva
+//   operands  i32 per handler, delta to the handler's own address for jnz, VM_INIT and calls, the raw value otherwise.
+//             wide_operand means the delta did not fit and is in the wide column
+//   wide      program_wide_t sorted by handler index
+//   blocks    program_block_t, split_blocks of the program
+//   edges     program_edge_t, block to successor block, block_count is the routine exit
+constexpr uint32_t program_magic = 0x47505644;	// "DVPG"
+constexpr uint16_t program_version = 1;
+constexpr int32_t wide_operand = INT32_MIN;
+
+struct program_header_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint64_t image_base;
+	uint64_t routine_va;
+	uint64_t file_size;
+	uint32_t handler_count;
+	uint32_t wide_count;
+	uint32_t block_count;
+	uint32_t edge_count;
+
+	// from the start of the file
+	uint64_t opcodes_offset;
+	uint64_t sizes_offset;
+	uint64_t addresses_offset;
+	uint64_t operands_offset;
+	uint64_t wide_offset;
+	uint64_t blocks_offset;
+	uint64_t edges_offset;
+};
+
+struct program_wide_t
+{
+	uint32_t index;
+	uint32_t reserved;
+	int64_t delta;
+};
+
+struct program_block_t
+{
+	uint32_t first;
+	uint32_t last;
+	int64_t entry_height;	// INT64_MIN when the paths into the block disagree
+};
+
+struct program_edge_t
+{
+	uint32_t from;
+	uint32_t to;
+};
+
+// what a vm_program reads its handlers from, pointers into the mapping
+struct program_columns_t
+{
+	uint64_t image_base;
+	const uint8_t* opcodes;
+	const uint8_t* sizes;
+	const uint32_t* addresses;
+	const int32_t* operands;
+	llvm::ArrayRef<program_wide_t> wide;
+	llvm::ArrayRef<program_block_t> blocks;
+};
+
+class program_file
+{
+public:
+	static bool write(const std::string& path, const vm_program& handlers, uint64_t image_base, uint64_t routine_va);
+
+	// nullptr after printing why, the file stays mapped for as long as the program_file lives
+	static std::unique_ptr<program_file> map(const std::string& path);
+
+	vm_program program() const { return vm_program(&columns, header->handler_count); }
+	const program_header_t& info() const { return *header; }
+	llvm::ArrayRef<program_edge_t> edges() const { return cfg; }
+
+private:
+	llvm::sys::fs::mapped_file_region region;
+	const program_header_t* header = nullptr;
+	program_columns_t columns = {};
+	llvm::ArrayRef<program_edge_t> cfg;
+};
@@ -0,0 +1,207 @@
+#include "recompiler.hpp"
+
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+recompiler_t::recompiler_t()
+{
+	LLVMInitializeX86TargetInfo();
+	LLVMInitializeX86Target();
+	LLVMInitializeX86TargetMC();
+	LLVMInitializeX86AsmPrinter();
+
+	std::string triple = "x86_64-pc-windows-msvc";
+	std::string error;
+	const Target* target = TargetRegistry::lookupTarget(triple, error);
+	if (!target)
+	{
+		errs() << "Error looking up target: " << error << "\n";
+		return;
+	}
+
+	target_machine.reset(target->createTargetMachine(triple, "x86-64", "", TargetOptions(),
+		Reloc::PIC_, CodeModel::Small, CodeGenOptLevel::Aggressive));
+}
+
+bool recompiler_t::emit_object(llvm::Module& module, llvm::SmallVectorImpl<char>& buffer)
+{
+	if (!target_machine)
+		return false;
+
+	// the lifter keeps its module, codegen works on a copy retargeted to win64
+	std::unique_ptr<Module> clone = CloneModule(module);
+	clone->setTargetTriple(target_machine->getTargetTriple().str());
+	clone->setDataLayout(target_machine->createDataLayout());
+
+	// the code is copied into a bare section, so it may not reference anything outside itself
+	for (Function& function : *clone)
+	{
+		if (function.isDeclaration())
+			continue;
+		function.addFnAttr("no-jump-tables", "true");
+		function.addFnAttr(Attribute::NoUnwind);
+	}
+
+	raw_svector_ostream stream(buffer);
+
+	legacy::PassManager PM;
+	if (target_machine->addPassesToEmitFile(PM, stream, nullptr, CodeGenFileType::ObjectFile))
+	{
+		errs() << "Error: target cannot emit object files\n";
+		return false;
+	}
+	PM.run(*clone);
+	return true;
+}
+
+size_t recompiler_t::emitted_size(llvm::Module& module)
+{
+	SmallVector<char, 0> buffer;
+	if (!emit_object(module, buffer))
+		return 0;
+
+	auto object = object::ObjectFile::createObjectFile(MemoryBufferRef(StringRef(buffer.data(), buffer.size()), "image.obj"));
+	if (!object)
+	{
+		errs() << "Error reading object: " << toString(object.takeError()) << "\n";
+		return 0;
+	}
+
+	size_t size = 0;
+	for (const object::SectionRef& section : (*object)->sections())
+	{
+		if (section.isText())
+			size += section.getSize();
+	}
+	return size;
+}
+
+bool recompiler_t::compile(llvm::Module& module, std::vector<uint8_t>& code)
+{
+	SmallVector<char, 0> buffer;
+	if (!emit_object(module, buffer))
+		return false;
+
+	auto object = object::ObjectFile::createObjectFile(MemoryBufferRef(StringRef(buffer.data(), buffer.size()), "devirtualized.obj"));
+	if (!object)
+	{
+		errs() << "Error reading object: " << toString(object.takeError()) << "\n";
+		return false;
+	}
+
+	for (const object::SymbolRef& symbol : (*object)->symbols())
+	{
+		auto name = symbol.getName();
+		if (!name)
+		{
+			consumeError(name.takeError());
+			continue;
+		}
+		if (*name != "devirtualized")
+			continue;
+
+		auto section = symbol.getSection();
+		auto offset = symbol.getValue();
+		if (!section || !offset || *section == (*object)->section_end())
+		{
+			errs() << "Error: devirtualized has no section\n";
+			if (!section)
+				consumeError(section.takeError());
+			if (!offset)
+				consumeError(offset.takeError());
+			return false;
+		}
+
+		if (!(*section)->relocations().empty())
+		{
+			errs() << "Error: recompiled code has relocations\n";
+			return false;
+		}
+
+		auto contents = (*section)->getContents();
+		if (!contents)
+		{
+			errs() << "Error reading section: " << toString(contents.takeError()) << "\n";
+			return false;
+		}
+
+		code.assign(contents->begin() + *offset, contents->end());
+		return true;
+	}
+
+	errs() << "Error: devirtualized not found in the emitted object\n";
+	return false;
+}
+
+std::vector<uint8_t> recompiler_t::context_thunk(uint32_t code_offset)
+{
+	// pushfq, then r15 down to rax so gpr[0] ends up at the lowest address. the return address plus
+	// 17 pushes leave rsp 16-byte aligned, so after the shadow space the call matches the win64 abi
+	std::vector<uint8_t> thunk =
+	{
+		0x9C,
+		0x41, 0x57, 0x41, 0x56, 0x41, 0x55, 0x41, 0x54, 0x41, 0x53, 0x41, 0x52, 0x41, 0x51, 0x41, 0x50,
+		0x57, 0x56, 0x55, 0x54, 0x53, 0x52, 0x51, 0x50,
+		0x48, 0x89, 0xE1,			// mov rcx, rsp
+		0x48, 0x83, 0xEC, 0x20,		// sub rsp, 0x20
+		0xE8, 0, 0, 0, 0,			// call code
+	};
+	size_t call_end = thunk.size();
+
+	std::vector<uint8_t> epilogue =
+	{
+		0x48, 0x83, 0xC4, 0x20,		// add rsp, 0x20
+		0x58, 0x59, 0x5A, 0x5B,
+		0x48, 0x83, 0xC4, 0x08,		// rsp is not restored from the state
+		0x5D, 0x5E, 0x5F,
+		0x41, 0x58, 0x41, 0x59, 0x41, 0x5A, 0x41, 0x5B, 0x41, 0x5C, 0x41, 0x5D, 0x41, 0x5E, 0x41, 0x5F,
+		0x9D,
+		0xC3
+	};
+	thunk.insert(thunk.end(), epilogue.begin(), epilogue.end());
+
+	int32_t displacement = (int32_t)(code_offset - call_end);
+	memcpy(&thunk[call_end - 4], &displacement, 4);
+	return thunk;
+}
+
+bool recompiler_t::patch(LIEF::PE::Binary& binary, uint64_t routine_va, const std::vector<uint8_t>& code, const std::string& output_path)
+{
+	std::vector<uint8_t> content = context_thunk(0);
+	uint32_t code_offset = (uint32_t)((content.size() + 15) & ~15);
+	content = context_thunk(code_offset);
+	content.resize(code_offset, 0xCC);
+	content.insert(content.end(), code.begin(), code.end());
+
+	LIEF::PE::Section section(".devirt");
+	section.content(content);
+	section.characteristics(SCN_CNT_CODE | SCN_MEM_EXECUTE | SCN_MEM_READ);
+
+	LIEF::PE::Section* added = binary.add_section(section);
+	if (!added)
+	{
+		std::cerr << "[!] Failed to add the .devirt section!" << std::endl;
+		return false;
+	}
+
+	// replace the push imm; jmp vm_entry stub with a jump to the thunk in front of the recompiled function
+	uint64_t target_va = binary.optional_header().imagebase() + added->virtual_address();
+	int32_t displacement = (int32_t)(target_va - (routine_va + 5));
+
+	std::vector<uint8_t> stub = { 0xE9 };
+	stub.insert(stub.end(), (uint8_t*)&displacement, (uint8_t*)&displacement + 4);
+	binary.patch_address(routine_va, stub);
+
+	// the lifted code embeds absolute addresses from the preferred base, no relocations are emitted for them
+	LIEF::PE::OptionalHeader& header = binary.optional_header();
+	if (header.dll_characteristics() & DLLCHARACTERISTICS_DYNAMIC_BASE)
+	{
+		header.dll_characteristics(header.dll_characteristics() & ~DLLCHARACTERISTICS_DYNAMIC_BASE);
+		std::cerr << "[!] Cleared DYNAMIC_BASE, " << output_path << " loads at its preferred base only" << std::endl;
+	}
+
+	binary.write(output_path);
+	return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "vm.hpp"
+
+#include <llvm/Target/TargetMachine.h>
+
+// emits the optimized devirtualized function as x86-64 machine code and patches it into the input image,
+// behind a thunk that turns the live registers into the cpu_state_t argument
+class recompiler_t
+{
+public:
+	static constexpr uint32_t SCN_CNT_CODE = 0x00000020;
+	static constexpr uint32_t SCN_MEM_EXECUTE = 0x20000000;
+	static constexpr uint32_t SCN_MEM_READ = 0x40000000;
+	static constexpr uint32_t DLLCHARACTERISTICS_DYNAMIC_BASE = 0x0040;
+
+	recompiler_t();
+
+	// spills the native registers into a cpu_state_t on the stack, calls the code right after it and reloads them
+	static std::vector<uint8_t> context_thunk(uint32_t code_offset);
+
+	bool compile(llvm::Module& module, std::vector<uint8_t>& code);
+
+	// bytes of machine code in the text sections the whole module compiles to, 0 when it cannot be emitted
+	size_t emitted_size(llvm::Module& module);
+
+	// the recompiled code holds absolute guest and iat addresses without base relocations, so the output image
+	// loses DYNAMIC_BASE and always loads at its preferred base
+	bool patch(LIEF::PE::Binary& binary, uint64_t routine_va, const std::vector<uint8_t>& code, const std::string& output_path);
+
+private:
+	std::unique_ptr<llvm::TargetMachine> target_machine;
+
+	bool emit_object(llvm::Module& module, llvm::SmallVectorImpl<char>& buffer);
+};
@@ -0,0 +1,531 @@
+#include "semantics.hpp"
+#include "signature_db.hpp"
+
+#include <llvm/Support/xxhash.h>
+
+namespace
+{
+	enum gpr_t { GPR_RSP = 4, GPR_R13 = 13, GPR_R14 = 14, GPR_R15 = 15 };
+
+	struct sym_t
+	{
+		enum kind_t : uint8_t
+		{
+			INITIAL,	// register value on handler entry, value is the register
+			CONSTANT,
+			OPERAND,	// bytecode at r13 + value
+			VSTACK,		// vstack at r15 + value
+			VREG,		// vreg indexed by lhs
+			GUEST,		// guest memory at lhs
+			FLAGS,		// rflags after computing lhs
+			SCRATCH,	// native stack at rsp + value, a location only
+			BINARY,		// lhs alu rhs
+			OPAQUE
+		} kind;
+		int64_t value = 0;
+		int size = 64;
+		v_alu_t alu = ALU_NONE;
+		int lhs = -1;
+		int rhs = -1;
+	};
+
+	struct access_t
+	{
+		int value;
+		int size;
+	};
+
+	// walks one handler, keeping every register and the memory it touches as expressions over the entry state
+	class native_evaluator
+	{
+	public:
+		native_evaluator()
+		{
+			for (int i = 0; i < 16; i++)
+				regs[i] = make({ sym_t::INITIAL, i });
+		}
+
+		// returns false once the handler jumps to the next one, returns or does something unmodeled
+		bool step(const native_instruction_t& instruction)
+		{
+			const ZydisDecodedOperand* operands = instruction.operands;
+
+			switch (instruction.i.mnemonic)
+			{
+			case ZYDIS_MNEMONIC_NOP:
+				return true;
+			case ZYDIS_MNEMONIC_MOV:
+			case ZYDIS_MNEMONIC_MOVZX:
+				write(operands[0], read(operands[1]));
+				return true;
+			case ZYDIS_MNEMONIC_LEA:
+				if (operands[1].mem.index != ZYDIS_REGISTER_NONE)
+					return unsupported();
+				write(operands[0], offset(reg(operands[1].mem.base), operands[1].mem.disp.value));
+				return true;
+			case ZYDIS_MNEMONIC_ADD:
+			case ZYDIS_MNEMONIC_SUB:
+			case ZYDIS_MNEMONIC_OR:
+			case ZYDIS_MNEMONIC_AND:
+			case ZYDIS_MNEMONIC_XOR:
+				compute(instruction.i.mnemonic, operands[0], read(operands[1]));
+				return true;
+			case ZYDIS_MNEMONIC_INC:
+			case ZYDIS_MNEMONIC_DEC:
+				compute(instruction.i.mnemonic == ZYDIS_MNEMONIC_INC ? ZYDIS_MNEMONIC_ADD : ZYDIS_MNEMONIC_SUB, operands[0], make({ sym_t::CONSTANT, 1 }));
+				return true;
+			case ZYDIS_MNEMONIC_PUSH:
+				push(read(operands[0]));
+				return true;
+			case ZYDIS_MNEMONIC_POP:
+				write(operands[0], pop());
+				return true;
+			case ZYDIS_MNEMONIC_PUSHFQ:
+				push(make({ sym_t::FLAGS, 0, 64, ALU_NONE, last_result }));
+				return true;
+			case ZYDIS_MNEMONIC_POPFQ:
+				flags = pop();
+				return true;
+			case ZYDIS_MNEMONIC_CMOVNZ:
+				// r13 keeps the fall-through, the taken side is what a JNZ operand encodes
+				branch_target = read(operands[1]);
+				return true;
+			case ZYDIS_MNEMONIC_JMP:
+				if (operands[0].type != ZYDIS_OPERAND_TYPE_REGISTER)
+					return unsupported();
+				next_handler = read(operands[0]);
+				return false;
+			case ZYDIS_MNEMONIC_RET:
+				exits = true;
+				return false;
+			default:
+				return unsupported();
+			}
+		}
+
+		handler_summary_t summarize() const
+		{
+			handler_summary_t summary = {};
+			if (!supported)
+				return summary;
+
+			// the exit handler pops r13 with the rest of the context, so it has no vip advance to check
+			if (exits)
+			{
+				summary.exits = true;
+				summary.opcode = VM_EXIT;
+				return summary;
+			}
+
+			auto vip = affine(regs[GPR_R13]);
+			if (!vip || vip->first != GPR_R13)
+				return summary;
+			summary.instr_size = (int)vip->second;
+
+			// the vsp either moved by a constant or was replaced by a popped value
+			const sym_t& vsp = syms[regs[GPR_R15]];
+			auto moved = affine(regs[GPR_R15]);
+			if (moved && moved->first == GPR_R15)
+				summary.stack_effect = (int16_t)moved->second;
+			else if (vsp.kind == sym_t::VSTACK && vsp.value == 0)
+			{
+				summary.stack_effect = vsp.size / 8;
+				summary.width = vsp.size;
+				return match(summary);
+			}
+			else
+				return summary;
+
+			if (branch_target != -1)
+			{
+				summary.operand = OPERAND_TARGET;
+				summary.width = 64;
+				summary.flags = FLAGS_POP_ZF;
+				return match(summary);
+			}
+
+			if (vreg_writes.size() == 1)
+			{
+				summary.operand = OPERAND_VREG;
+				summary.width = vreg_writes[0].second.size;
+				return match(summary);
+			}
+
+			if (guest_writes.size() == 1)
+			{
+				summary.width = guest_writes[0].second.size;
+				return match(summary);
+			}
+
+			for (const auto& [offset, write] : vstack_writes)
+			{
+				const sym_t& value = syms[write.value];
+				switch (value.kind)
+				{
+				case sym_t::FLAGS:
+					summary.flags = FLAGS_PUSH_ZF;
+					break;
+				case sym_t::BINARY:
+					summary.alu = value.alu;
+					summary.width = write.size;
+					break;
+				case sym_t::VREG:
+					summary.operand = OPERAND_VREG;
+					summary.width = write.size;
+					break;
+				case sym_t::OPERAND:
+					summary.operand = OPERAND_IMM;
+					summary.width = write.size;
+					break;
+				case sym_t::INITIAL:
+				case sym_t::GUEST:
+					summary.width = write.size;
+					break;
+				default:
+					break;
+				}
+			}
+			return match(summary);
+		}
+
+	private:
+		std::vector<sym_t> syms;
+		int regs[16];
+		std::map<int64_t, access_t> vstack_writes;
+		std::map<int64_t, int> scratch;	// native stack the handler pushes to
+		std::vector<std::pair<int, access_t>> vreg_writes;
+		std::vector<std::pair<int, access_t>> guest_writes;
+		int last_result = -1;
+		int flags = -1;
+		int branch_target = -1;
+		int next_handler = -1;
+		bool exits = false;
+		bool supported = true;
+
+		int make(sym_t sym)
+		{
+			syms.push_back(sym);
+			return (int)syms.size() - 1;
+		}
+
+		bool unsupported()
+		{
+			supported = false;
+			return false;
+		}
+
+		int reg(ZydisRegister reg) const
+		{
+			ZydisRegister largest = ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, reg);
+			return largest >= ZYDIS_REGISTER_RAX && largest <= ZYDIS_REGISTER_R15 ? regs[largest - ZYDIS_REGISTER_RAX] : -1;
+		}
+
+		// INITIAL register plus a constant, the only shape r13, r15 and rsp take in a handler
+		std::optional<std::pair<int64_t, int64_t>> affine(int index) const
+		{
+			if (index < 0)
+				return std::nullopt;
+
+			const sym_t& sym = syms[index];
+			if (sym.kind == sym_t::INITIAL)
+				return std::make_pair(sym.value, (int64_t)0);
+
+			if (sym.kind == sym_t::BINARY && (sym.alu == ALU_ADD || sym.alu == ALU_SUB) && syms[sym.rhs].kind == sym_t::CONSTANT)
+			{
+				auto base = affine(sym.lhs);
+				if (base)
+					return std::make_pair(base->first, base->second + (sym.alu == ALU_ADD ? syms[sym.rhs].value : -syms[sym.rhs].value));
+			}
+			return std::nullopt;
+		}
+
+		int offset(int base, int64_t delta)
+		{
+			if (base < 0)
+				return make({ sym_t::OPAQUE });
+
+			auto moved = affine(base);
+			if (!moved)
+				return make({ sym_t::BINARY, 0, 64, ALU_ADD, base, make({ sym_t::CONSTANT, delta }) });
+			if (moved->second + delta == 0)
+				return make({ sym_t::INITIAL, moved->first });
+			return make({ sym_t::BINARY, 0, 64, ALU_ADD, make({ sym_t::INITIAL, moved->first }), make({ sym_t::CONSTANT, moved->second + delta }) });
+		}
+
+		struct location_t
+		{
+			sym_t::kind_t kind;
+			int64_t offset;
+			int index;	// vreg index or guest address
+		};
+
+		location_t locate(const ZydisDecodedOperand& operand)
+		{
+			const ZydisDecodedOperandMem& mem = operand.mem;
+			int base = mem.base == ZYDIS_REGISTER_NONE ? make({ sym_t::CONSTANT, 0 }) : reg(mem.base);
+			auto moved = mem.segment == ZYDIS_REGISTER_GS || mem.segment == ZYDIS_REGISTER_FS ? std::nullopt : affine(base);
+
+			if (mem.index != ZYDIS_REGISTER_NONE)
+			{
+				if (moved && moved->first == GPR_RSP && mem.scale == 8)
+					return { sym_t::VREG, 0, reg(mem.index) };
+				return { sym_t::OPAQUE, 0, -1 };
+			}
+
+			if (moved && moved->first == GPR_R13)
+				return { sym_t::OPERAND, moved->second + mem.disp.value, -1 };
+			if (moved && moved->first == GPR_R15)
+				return { sym_t::VSTACK, moved->second + mem.disp.value, -1 };
+			if (moved && moved->first == GPR_RSP)
+				return { sym_t::SCRATCH, moved->second + mem.disp.value, -1 };
+			return { sym_t::GUEST, 0, offset(base, mem.disp.value) };
+		}
+
+		int load(const ZydisDecodedOperand& operand)
+		{
+			location_t location = locate(operand);
+			int size = operand.size;
+
+			switch (location.kind)
+			{
+			case sym_t::VSTACK:
+			{
+				auto it = vstack_writes.find(location.offset);
+				if (it != vstack_writes.end() && it->second.size == size)
+					return it->second.value;
+				return make({ sym_t::VSTACK, location.offset, size });
+			}
+			case sym_t::SCRATCH:
+			{
+				auto it = scratch.find(location.offset);
+				return it != scratch.end() ? it->second : make({ sym_t::OPAQUE });
+			}
+			case sym_t::OPERAND:
+				return make({ sym_t::OPERAND, location.offset, size });
+			case sym_t::VREG:
+				return make({ sym_t::VREG, 0, size, ALU_NONE, location.index });
+			case sym_t::GUEST:
+				return make({ sym_t::GUEST, 0, size, ALU_NONE, location.index });
+			default:
+				return make({ sym_t::OPAQUE });
+			}
+		}
+
+		void store(const ZydisDecodedOperand& operand, int value)
+		{
+			location_t location = locate(operand);
+			access_t access = { value, operand.size };
+
+			switch (location.kind)
+			{
+			case sym_t::VSTACK:
+				vstack_writes[location.offset] = access;
+				break;
+			case sym_t::SCRATCH:
+				scratch[location.offset] = value;
+				break;
+			case sym_t::VREG:
+				vreg_writes.emplace_back(location.index, access);
+				break;
+			case sym_t::GUEST:
+				guest_writes.emplace_back(location.index, access);
+				break;
+			default:
+				supported = false;
+				break;
+			}
+		}
+
+		int read(const ZydisDecodedOperand& operand)
+		{
+			switch (operand.type)
+			{
+			case ZYDIS_OPERAND_TYPE_REGISTER:
+			{
+				int value = reg(operand.reg.value);
+				return value < 0 ? make({ sym_t::OPAQUE }) : value;
+			}
+			case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+				return make({ sym_t::CONSTANT, operand.imm.value.s });
+			case ZYDIS_OPERAND_TYPE_MEMORY:
+				return load(operand);
+			default:
+				return make({ sym_t::OPAQUE });
+			}
+		}
+
+		void write(const ZydisDecodedOperand& operand, int value)
+		{
+			if (operand.type == ZYDIS_OPERAND_TYPE_MEMORY)
+				return store(operand, value);
+
+			ZydisRegister largest = ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, operand.reg.value);
+			if (operand.type != ZYDIS_OPERAND_TYPE_REGISTER || largest < ZYDIS_REGISTER_RAX || largest > ZYDIS_REGISTER_R15)
+			{
+				supported = false;
+				return;
+			}
+			regs[largest - ZYDIS_REGISTER_RAX] = value;
+		}
+
+		void compute(ZydisMnemonic mnemonic, const ZydisDecodedOperand& destination, int rhs)
+		{
+			static const std::pair<ZydisMnemonic, v_alu_t> alu_of[] =
+			{
+				{ ZYDIS_MNEMONIC_ADD, ALU_ADD },
+				{ ZYDIS_MNEMONIC_SUB, ALU_SUB },
+				{ ZYDIS_MNEMONIC_OR, ALU_OR },
+				{ ZYDIS_MNEMONIC_AND, ALU_AND },
+				{ ZYDIS_MNEMONIC_XOR, ALU_XOR }
+			};
+
+			v_alu_t alu = ALU_NONE;
+			for (const auto& [candidate, kind] : alu_of)
+			{
+				if (candidate == mnemonic)
+					alu = kind;
+			}
+
+			int lhs = read(destination);
+			int result;
+			if ((alu == ALU_ADD || alu == ALU_SUB) && syms[rhs].kind == sym_t::CONSTANT && affine(lhs))
+				result = offset(lhs, alu == ALU_ADD ? syms[rhs].value : -syms[rhs].value);
+			else
+				result = make({ sym_t::BINARY, 0, destination.size, alu, lhs, rhs });
+
+			write(destination, result);
+			last_result = result;
+		}
+
+		void push(int value)
+		{
+			regs[GPR_RSP] = offset(regs[GPR_RSP], -8);
+			ZydisDecodedOperand top = {};
+			top.type = ZYDIS_OPERAND_TYPE_MEMORY;
+			top.size = 64;
+			top.mem.base = ZYDIS_REGISTER_RSP;
+			store(top, value);
+		}
+
+		int pop()
+		{
+			ZydisDecodedOperand top = {};
+			top.type = ZYDIS_OPERAND_TYPE_MEMORY;
+			top.size = 64;
+			top.mem.base = ZYDIS_REGISTER_RSP;
+			int value = load(top);
+			regs[GPR_RSP] = offset(regs[GPR_RSP], 8);
+			return value;
+		}
+
+		static handler_summary_t match(handler_summary_t summary)
+		{
+			summary.opcode = semantics_cache::classify(summary);
+			return summary;
+		}
+	};
+}
+
+// the signature picks the opcode_table row, so a handler is recognized by what it does and not where it is. only
+// known behaviour is recognized this way: lift_core lifts by opcode, so a handler doing something no row describes
+// (a new width, alu or operand kind) still needs its own row, and a case in lift_core unless the default alu case
+// covers it
+v_opcode_t semantics_cache::classify(const handler_summary_t& summary)
+{
+	if (summary.exits)
+		return VM_EXIT;
+
+	for (const opcode_desc_t& desc : opcode_table)
+	{
+		if (desc.handler != 0 && desc.operand == summary.operand && desc.width == summary.width &&
+			desc.stack_effect == summary.stack_effect && desc.flags == summary.flags && desc.alu == summary.alu)
+		{
+			return desc.opcode;
+		}
+	}
+	return UNKNOWN;
+}
+
+semantics_cache::semantics_cache(LIEF::PE::Binary& binary_, signature_db* signatures_)
+	: binary(binary_), signatures(signatures_)
+{
+}
+
+uint64_t semantics_cache::fingerprint(const std::vector<native_instruction_t>& instructions)
+{
+	std::vector<uint64_t> words;
+	for (const native_instruction_t& instruction : instructions)
+	{
+		words.push_back(instruction.i.mnemonic);
+		for (int i = 0; i < instruction.i.operand_count_visible; i++)
+		{
+			const ZydisDecodedOperand& operand = instruction.operands[i];
+			words.push_back(((uint64_t)operand.type << 16) | operand.size);
+			switch (operand.type)
+			{
+			case ZYDIS_OPERAND_TYPE_REGISTER:
+				words.push_back(operand.reg.value);
+				break;
+			case ZYDIS_OPERAND_TYPE_MEMORY:
+				words.push_back(((uint64_t)operand.mem.base << 32) | ((uint64_t)operand.mem.index << 8) | operand.mem.scale);
+				words.push_back(operand.mem.base == ZYDIS_REGISTER_RIP ? 0 : operand.mem.disp.value);
+				break;
+			case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+				words.push_back(operand.imm.is_relative ? 0 : operand.imm.value.u);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	uint64_t hash = xxHash64(StringRef((const char*)words.data(), words.size() * sizeof(uint64_t)));
+	return hash ? hash : 1;	// 0 marks a free slot
+}
+
+handler_summary_t semantics_cache::analyze(const std::vector<native_instruction_t>& instructions)
+{
+	native_evaluator evaluator;
+	for (const native_instruction_t& instruction : instructions)
+	{
+		if (!evaluator.step(instruction))
+			break;
+	}
+	return evaluator.summarize();
+}
+
+const handler_summary_t& semantics_cache::summarize(uint64_t handler_address)
+{
+	auto it = summaries.find(handler_address);
+	if (it != summaries.end())
+		return it->second;
+
+	auto handler_content = disassemble(binary.get_content_from_virtual_address(handler_address, 64), handler_address, ZYDIS_MNEMONIC_JMP);
+
+	uint64_t handler_fingerprint = signatures ? fingerprint(handler_content) : 0;
+	std::optional<handler_summary_t> stored = signatures ? signatures->find(handler_fingerprint) : std::nullopt;
+
+	handler_summary_t summary;
+	if (stored)
+		summary = *stored;
+	else
+	{
+		summary = analyze(handler_content);
+		if (signatures && summary.opcode != UNKNOWN)
+			signatures->insert(handler_fingerprint, summary);
+	}
+
+	v_opcode_t known = opcode_from_handler(handler_address);
+	if (known != UNKNOWN && known != summary.opcode)
+	{
+		std::cerr << "[!] Handler 0x" << std::hex << handler_address << std::dec << " looks like " << describe(summary.opcode).name
+			<< " but the table has it as " << describe(known).name << std::endl;
+	}
+	else if (summary.opcode == UNKNOWN)
+	{
+		std::cerr << "[!] Handler 0x" << std::hex << handler_address << std::dec << " matches no opcode (operand " << (int)summary.operand
+			<< ", width " << (int)summary.width << ", vsp " << summary.stack_effect << ", alu " << (int)summary.alu << ")" << std::endl;
+	}
+
+	return summaries.emplace(handler_address, summary).first->second;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "vm.hpp"
+
+// what a native handler does to the VM, derived from its x86 code: r13 is the vip, r15 the vsp,
+// [rsp + i*8] the vregs and r14 the image base the next handler offset is added to
+struct handler_summary_t
+{
+	v_opcode_t opcode = UNKNOWN;	// table row with the same signature
+	int instr_size = 0;				// r13 advance, the trailing 4 bytes are the next handler offset
+	v_operand_t operand = OPERAND_NONE;
+	uint8_t width = 0;
+	int16_t stack_effect = 0;
+	v_flags_t flags = FLAGS_NONE;
+	v_alu_t alu = ALU_NONE;
+	bool exits = false;
+};
+
+class signature_db;
+
+// analyzes every unique handler address once, all instances of a handler share its summary. with a signature
+// database, handlers any process already analyzed are looked up by fingerprint instead
+class semantics_cache
+{
+public:
+	semantics_cache(LIEF::PE::Binary& binary_, signature_db* signatures_ = nullptr);
+
+	const handler_summary_t& summarize(uint64_t handler_address);
+	size_t size() const { return summaries.size(); }
+
+	// runs the handler's instructions through the evaluator, with no lookups and no table check
+	static handler_summary_t analyze(const std::vector<native_instruction_t>& instructions);
+
+	// the opcode_table row a summary's signature matches, UNKNOWN for none
+	static v_opcode_t classify(const handler_summary_t& summary);
+
+	// the handler's instructions with relative targets and rip displacements left out, so it does not depend on
+	// where the handler was placed
+	static uint64_t fingerprint(const std::vector<native_instruction_t>& instructions);
+
+private:
+	LIEF::PE::Binary& binary;
+	signature_db* signatures;
+	std::unordered_map<uint64_t, handler_summary_t> summaries;
+};
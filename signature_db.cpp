@@ -0,0 +1,148 @@
+#include "signature_db.hpp"
+
+#include <llvm/Support/Process.h>
+
+std::unique_ptr<signature_db> signature_db::open(const std::string& path, uint64_t capacity)
+{
+	int fd = -1;
+	if (std::error_code error = sys::fs::openFileForReadWrite(path, fd, sys::fs::CD_OpenAlways, sys::fs::OF_None))
+	{
+		errs() << "Error opening " << path << ": " << error.message() << "\n";
+		return nullptr;
+	}
+
+	// every process that finds the file short grows it to the same size, the new bytes read as free slots
+	uint64_t file_size = 0;
+	uint64_t wanted = sizeof(signature_header_t) + capacity * sizeof(signature_slot_t);
+	sys::fs::file_status status;
+	std::error_code error = sys::fs::status(fd, status);
+	if (!error)
+	{
+		file_size = status.getSize();
+		if (file_size < sizeof(signature_header_t))
+		{
+			error = sys::fs::resize_file(fd, wanted);
+			file_size = wanted;
+		}
+	}
+
+	auto result = std::make_unique<signature_db>();
+	if (!error)
+		result->region = sys::fs::mapped_file_region(sys::fs::convertFDToNativeFile(fd), sys::fs::mapped_file_region::readwrite, file_size, 0, error);
+	sys::Process::SafelyCloseFileDescriptor(fd);
+	if (error)
+	{
+		errs() << "Error mapping " << path << ": " << error.message() << "\n";
+		return nullptr;
+	}
+
+	signature_header_t* header = (signature_header_t*)result->region.data();
+	std::atomic_ref<uint32_t> magic(header->magic);
+	if (magic.load(std::memory_order_acquire) == 0)
+	{
+		// racing creators write the same values
+		header->version = signature_version;
+		header->capacity = capacity;
+		magic.store(signature_magic, std::memory_order_release);
+	}
+
+	if (magic.load(std::memory_order_acquire) != signature_magic || header->version != signature_version)
+	{
+		errs() << "Error mapping " << path << ": not a version " << signature_version << " signature database\n";
+		return nullptr;
+	}
+
+	if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+		header->capacity > (file_size - sizeof(signature_header_t)) / sizeof(signature_slot_t))
+	{
+		errs() << "Error mapping " << path << ": the slot table is out of the file\n";
+		return nullptr;
+	}
+
+	result->header = header;
+	result->slots = (signature_slot_t*)(header + 1);
+	result->mask = header->capacity - 1;
+	return result;
+}
+
+// 0 marks a free slot, semantics_cache::fingerprint never returns it but nothing else should store it either
+static uint64_t slot_fingerprint(uint64_t fingerprint)
+{
+	return fingerprint ? fingerprint : 1;
+}
+
+std::optional<handler_summary_t> signature_db::find(uint64_t fingerprint)
+{
+	fingerprint = slot_fingerprint(fingerprint);
+	for (uint64_t i = 0; i <= mask; i++)
+	{
+		signature_slot_t& slot = slots[(fingerprint + i) & mask];
+		uint64_t current = std::atomic_ref<uint64_t>(slot.fingerprint).load(std::memory_order_acquire);
+		if (current == 0)
+			break;
+
+		if (current != fingerprint || !std::atomic_ref<uint32_t>(slot.ready).load(std::memory_order_acquire))
+			continue;
+
+		handler_summary_t summary;
+		summary.instr_size = slot.instr_size;
+		summary.operand = (v_operand_t)slot.operand;
+		summary.width = slot.width;
+		summary.stack_effect = slot.stack_effect;
+		summary.flags = (v_flags_t)slot.flags;
+		summary.alu = (v_alu_t)slot.alu;
+		summary.exits = slot.exits != 0;
+		summary.opcode = semantics_cache::classify(summary);
+
+		hits.fetch_add(1, std::memory_order_relaxed);
+		return summary;
+	}
+
+	misses.fetch_add(1, std::memory_order_relaxed);
+	return std::nullopt;
+}
+
+void signature_db::insert(uint64_t fingerprint, const handler_summary_t& summary)
+{
+	fingerprint = slot_fingerprint(fingerprint);
+	for (uint64_t i = 0; i <= mask; i++)
+	{
+		signature_slot_t& slot = slots[(fingerprint + i) & mask];
+		uint64_t expected = 0;
+		if (!std::atomic_ref<uint64_t>(slot.fingerprint).compare_exchange_strong(expected, fingerprint, std::memory_order_acq_rel))
+		{
+			// another writer got there first, it computed the same summary
+			if (expected == fingerprint)
+				return;
+			continue;
+		}
+
+		slot.instr_size = summary.instr_size;
+		slot.opcode = (uint8_t)summary.opcode;
+		slot.operand = (uint8_t)summary.operand;
+		slot.width = summary.width;
+		slot.stack_effect = summary.stack_effect;
+		slot.flags = (uint8_t)summary.flags;
+		slot.alu = (uint8_t)summary.alu;
+		slot.exits = summary.exits;
+		std::atomic_ref<uint32_t>(slot.ready).store(1, std::memory_order_release);
+
+		std::atomic_ref<uint64_t>(header->count).fetch_add(1, std::memory_order_relaxed);
+		added.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	if (!warned_full.exchange(true))
+		std::cerr << "[!] The signature database is full, new handlers are not stored" << std::endl;
+}
+
+uint64_t signature_db::size() const
+{
+	return std::atomic_ref<uint64_t>(header->count).load(std::memory_order_relaxed);
+}
+
+void signature_db::report(llvm::raw_ostream& stream) const
+{
+	stream << "; signatures: " << hits.load() << " hits, " << misses.load() << " misses, " << added.load() << " added, "
+		<< size() << "/" << header->capacity << " stored\n";
+}
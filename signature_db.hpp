@@ -0,0 +1,65 @@
+#pragma once
+#include "semantics.hpp"
+
+#include <atomic>
+#include <llvm/Support/FileSystem.h>
+
+// handler summaries keyed by a normalized fingerprint of the handler's code, in a file every process maps shared.
+// the file is a header and an open addressing table that only ever grows: a writer claims a free slot by compare
+// exchanging its fingerprint in, fills the summary and publishes it with a release store of ready. lookups take no
+// lock and skip slots that are not published yet, so a handler analyzed by any process is never analyzed again
+//
+//   header   signature_header_t
+//   slots    capacity signature_slot_t, probed linearly from fingerprint & (capacity - 1)
+constexpr uint32_t signature_magic = 0x53475344;	// "DSGS"
+constexpr uint32_t signature_version = 1;
+
+struct signature_header_t
+{
+	uint32_t magic;		// stored last when the file is created
+	uint32_t version;
+	uint64_t capacity;	// power of two
+	uint64_t count;		// published slots, across every process
+	uint64_t reserved;
+};
+
+struct signature_slot_t
+{
+	uint64_t fingerprint;	// 0 while free
+	uint32_t ready;
+	int32_t instr_size;
+	uint8_t opcode;			// as classified when stored, lookups classify the signature below again
+	uint8_t operand;
+	uint8_t width;
+	uint8_t flags;
+	uint8_t alu;
+	uint8_t exits;
+	int16_t stack_effect;
+	uint64_t reserved;
+};
+static_assert(sizeof(signature_header_t) == 32 && sizeof(signature_slot_t) == 32, "signature file layout changed");
+
+class signature_db
+{
+public:
+	// creates the file with capacity slots when it does not exist yet, nullptr after printing why
+	static std::unique_ptr<signature_db> open(const std::string& path, uint64_t capacity = 1 << 16);
+
+	std::optional<handler_summary_t> find(uint64_t fingerprint);
+	void insert(uint64_t fingerprint, const handler_summary_t& summary);
+
+	uint64_t size() const;
+	void report(llvm::raw_ostream& stream) const;
+
+private:
+	llvm::sys::fs::mapped_file_region region;
+	signature_header_t* header = nullptr;
+	signature_slot_t* slots = nullptr;
+	uint64_t mask = 0;
+
+	// this process only
+	std::atomic<uint64_t> hits = 0;
+	std::atomic<uint64_t> misses = 0;
+	std::atomic<uint64_t> added = 0;
+	std::atomic<bool> warned_full = false;
+};
@@ -0,0 +1,298 @@
+#include "tests.hpp"
+#include "program_file.hpp"
+#include "vtil_stream.hpp"
+#include "semantics.hpp"
+#include "cache.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <filesystem>
+#include <cstddef>
+#include <llvm/ADT/StringExtras.h>
+
+namespace
+{
+	bool fail(const std::string& why)
+	{
+		std::cerr << "[!] " << why << std::endl;
+		return false;
+	}
+
+	// a file or directory under the temp directory no other run uses
+	std::filesystem::path scratch_path(const std::string& name)
+	{
+		std::random_device random;
+		return std::filesystem::temp_directory_path() / ("devirtualizer-" + name + "-" + std::to_string(random()));
+	}
+
+	// VM_INIT, a loop that adds a far constant to vreg 3 and branches back on the flag, and VM_EXIT. the loop
+	// leaves the vstack as it found it, the constant needs a wide operand and the jnz a negative delta
+	std::vector<handler_t> looping_program()
+	{
+		std::vector<handler_t> handlers;
+		auto add = [&](v_opcode_t opcode, uint64_t data) {
+			handler_t handler = {};
+			handler.opcode = opcode;
+			handler.data = data;
+			handler.address = 0x2000 + (uint32_t)handlers.size() * 12;
+			handler.next_handler = handler.address + 12;
+			handler.instr_size = 12;
+			handlers.push_back(handler);
+		};
+
+		add(VM_INIT, 0x2000);
+		add(PUSH_VR64, 3);
+		add(PUSH_64, 0x9E3779B97F4A7C15ull);
+		add(ADD64, 0);
+		add(POP_VR64, 16);	// flags
+		add(POP_VR64, 3);
+		add(PUSH_VR64, 16);
+		add(JNZ, handlers[1].address);
+		add(VM_EXIT, 0);
+		return handlers;
+	}
+
+	bool same_handler(const handler_t& left, const handler_t& right)
+	{
+		return left.opcode == right.opcode && left.data == right.data && left.address == right.address && left.instr_size == right.instr_size;
+	}
+
+	// write, map, compare every handler and block, then a block table that no longer tiles the program is refused
+	bool test_program_file()
+	{
+		constexpr uint64_t image_base = 0x140000000;
+		std::vector<handler_t> handlers = looping_program();
+		std::string path = scratch_path("program").string();
+
+		if (!program_file::write(path, handlers, image_base, image_base + 0x1000))
+			return fail("cannot write " + path);
+
+		std::unique_ptr<program_file> mapped = program_file::map(path);
+		if (!mapped)
+		{
+			std::filesystem::remove(path);
+			return fail("cannot map the program just written");
+		}
+
+		bool passed = true;
+		vm_program program = mapped->program();
+		if (program.size() != handlers.size() || mapped->info().image_base != image_base || mapped->info().routine_va != image_base + 0x1000)
+			passed = fail("mapped header does not match what was written");
+
+		for (size_t i = 0; passed && i < handlers.size(); i++)
+		{
+			if (!same_handler(program[i], handlers[i]))
+				passed = fail("mapped handler " + std::to_string(i) + " differs from the written one");
+		}
+
+		std::vector<vm_block_t> expected = split_blocks(handlers);
+		std::vector<vm_block_t> blocks = split_blocks(program);
+		llvm::ArrayRef<program_block_t> stored = program.mapped()->blocks;
+		if (passed && (blocks.size() != expected.size() || stored.size() != expected.size()))
+			passed = fail("mapped program splits into a different number of blocks");
+
+		for (size_t i = 0; passed && i < expected.size(); i++)
+		{
+			if (blocks[i].first != expected[i].first || blocks[i].last != expected[i].last || blocks[i].entry_height != expected[i].entry_height ||
+				stored[i].first != expected[i].first || stored[i].last != expected[i].last || stored[i].entry_height != expected[i].entry_height.value_or(INT64_MIN))
+			{
+				passed = fail("block " + std::to_string(i) + " differs after mapping");
+			}
+		}
+
+		program_header_t header = mapped->info();
+		mapped.reset();
+
+		if (passed)
+		{
+			uint32_t last = header.handler_count + 1;
+			{
+				std::fstream stream(path, std::ios::binary | std::ios::in | std::ios::out);
+				stream.seekp(header.blocks_offset + offsetof(program_block_t, last));
+				stream.write((const char*)&last, sizeof(last));
+			}
+
+			std::cerr << "[+] mapping a damaged program, the error below is expected" << std::endl;
+			if (program_file::map(path))
+				passed = fail("a block past the last handler was mapped");
+		}
+
+		std::filesystem::remove(path);
+		return passed;
+	}
+
+	// every block comes back with the same vip, stack state, successors and instructions
+	bool test_vtil_stream()
+	{
+		std::vector<handler_t> handlers = looping_program();
+		vtil_lifter lifter(handlers);
+		lifter.lift();
+
+		std::stringstream stream;
+		vtil_stream_writer::save(lifter.rtn, stream);
+		std::unique_ptr<routine> loaded(vtil_stream_reader::load(stream));
+		if (!loaded)
+			return fail("the vtil stream does not read back");
+
+		if (loaded->explored_blocks.size() != lifter.rtn->explored_blocks.size() || loaded->num_instructions() != lifter.rtn->num_instructions())
+			return fail("the vtil stream reads back a different number of blocks or instructions");
+
+		for (const auto& [vip, block] : lifter.rtn->explored_blocks)
+		{
+			auto it = loaded->explored_blocks.find(vip);
+			if (it == loaded->explored_blocks.end())
+				return fail("block 0x" + llvm::utohexstr(vip) + " is missing after the round trip");
+
+			const basic_block* read = it->second;
+			if (read->sp_offset != block->sp_offset || read->sp_index != block->sp_index || read->size() != block->size() || read->next.size() != block->next.size())
+				return fail("block 0x" + llvm::utohexstr(vip) + " differs after the round trip");
+
+			for (size_t i = 0; i < block->next.size(); i++)
+			{
+				if (read->next[i]->entry_vip != block->next[i]->entry_vip)
+					return fail("block 0x" + llvm::utohexstr(vip) + " has different successors after the round trip");
+			}
+
+			auto written = block->begin();
+			for (const instruction& ins : *read)
+			{
+				if (ins.to_string() != written->to_string())
+					return fail("block 0x" + llvm::utohexstr(vip) + ": " + written->to_string() + " reads back as " + ins.to_string());
+				++written;
+			}
+		}
+		return true;
+	}
+
+	// a stored entry loads back unchanged, another tier misses, and a damaged handler count is a miss
+	bool test_cache()
+	{
+		std::filesystem::path directory = scratch_path("cache");
+		std::vector<handler_t> handlers = looping_program();
+
+		auto run = [&]() {
+			artifact_cache cache(directory);
+
+			LLVMContext context;
+			Module module("cached", context);
+			Function* function = Function::Create(FunctionType::get(Type::getInt64Ty(context), false), GlobalValue::ExternalLinkage, "vm_routine", module);
+			ReturnInst::Create(context, ConstantInt::get(Type::getInt64Ty(context), 42), BasicBlock::Create(context, "", function));
+
+			if (!cache.store("routine-O3", handlers, module))
+				return fail("cannot store a cache entry in " + directory.string());
+
+			std::vector<handler_t> loaded;
+			std::string bitcode;
+			if (!cache.load("routine-O3", loaded, bitcode))
+				return fail("the entry just stored misses");
+
+			if (loaded.size() != handlers.size())
+				return fail("the cache returns " + std::to_string(loaded.size()) + " handlers, " + std::to_string(handlers.size()) + " were stored");
+			for (size_t i = 0; i < handlers.size(); i++)
+			{
+				if (!same_handler(loaded[i], handlers[i]) || loaded[i].next_handler != handlers[i].next_handler)
+					return fail("cached handler " + std::to_string(i) + " differs from the stored one");
+			}
+
+			auto parsed = parseBitcodeFile(MemoryBufferRef(bitcode, "cached"), context);
+			if (!parsed)
+			{
+				consumeError(parsed.takeError());
+				return fail("the cached bitcode does not parse");
+			}
+			if (!(*parsed)->getFunction("vm_routine"))
+				return fail("the cached bitcode lost vm_routine");
+
+			if (cache.load("routine-O1", loaded, bitcode))
+				return fail("a tier that was never stored hits");
+
+			uint64_t handler_count = UINT64_MAX / 2;
+			{
+				std::fstream stream(directory / "routine-O3.bin", std::ios::binary | std::ios::in | std::ios::out);
+				stream.seekp(4);
+				stream.write((const char*)&handler_count, sizeof(handler_count));
+			}
+			if (cache.load("routine-O3", loaded, bitcode))
+				return fail("an entry with a damaged handler count hits");
+			return true;
+		};
+
+		bool passed = run();
+		std::error_code error;
+		std::filesystem::remove_all(directory, error);
+		return passed;
+	}
+
+	handler_summary_t summarize_bytes(const std::vector<uint8_t>& bytes)
+	{
+		return semantics_cache::analyze(disassemble(bytes, 0x140001000, ZYDIS_MNEMONIC_JMP));
+	}
+
+	// the exit handler pops r13 with the rest of the context, so it is recognized by its ret and not by a vip advance
+	bool test_summarizer()
+	{
+		const std::vector<uint8_t> exit_handler =
+		{
+			0x4C, 0x89, 0xFC,			// mov rsp, r15
+			0x9D,						// popfq
+			0x41, 0x5D,					// pop r13
+			0x58,						// pop rax
+			0xC3						// ret
+		};
+
+		handler_summary_t summary = summarize_bytes(exit_handler);
+		if (summary.opcode != VM_EXIT || !summary.exits)
+			return fail("the exit handler is summarized as " + std::string(describe(summary.opcode).name));
+
+		const std::vector<uint8_t> push_handler =
+		{
+			0x49, 0x8B, 0x45, 0x00,		// mov rax, [r13]
+			0x49, 0x83, 0xEF, 0x08,		// sub r15, 8
+			0x49, 0x89, 0x07,			// mov [r15], rax
+			0x49, 0x83, 0xC5, 0x08,		// add r13, 8
+			0x41, 0x8B, 0x45, 0x00,		// mov eax, [r13]
+			0x49, 0x83, 0xC5, 0x04,		// add r13, 4
+			0x4C, 0x01, 0xF0,			// add rax, r14
+			0xFF, 0xE0					// jmp rax
+		};
+
+		summary = summarize_bytes(push_handler);
+		if (summary.opcode != PUSH_64 || summary.instr_size != 12)
+		{
+			return fail("the push handler is summarized as " + std::string(describe(summary.opcode).name) + " with instr_size " +
+				std::to_string(summary.instr_size));
+		}
+		return true;
+	}
+}
+
+int run_self_tests()
+{
+	struct test_t
+	{
+		const char* name;
+		bool (*run)();
+	};
+
+	const test_t tests[] =
+	{
+		{ "program file round trip", test_program_file },
+		{ "vtil stream round trip", test_vtil_stream },
+		{ "cache round trip", test_cache },
+		{ "handler summarizer", test_summarizer }
+	};
+
+	int failed = 0;
+	for (const test_t& test : tests)
+	{
+		bool passed = test.run();
+		if (passed)
+			outs() << "[+] " << test.name << " passed\n";
+		else
+			std::cerr << "[!] " << test.name << " failed" << std::endl;
+		failed += !passed;
+	}
+	return failed;
+}
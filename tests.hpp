@@ -0,0 +1,6 @@
+#pragma once
+#include "vm.hpp"
+
+// round trips of the on-disk formats and the handler summarizer over synthetic input, no image needed.
+// prints every failed check and returns how many tests failed
+int run_self_tests();
@@ -0,0 +1,178 @@
+#include "tiered.hpp"
+
+#include <llvm/Support/Format.h>
+
+vm_tiered::vm_tiered(const image_memory_t* image_, const vm_program& handlers_, uint32_t threshold_)
+	: image(image_), handlers(handlers_), threshold(threshold_), interpreter(handlers_)
+{
+	blocks = split_blocks(handlers);
+	block_at.assign(handlers.size(), SIZE_MAX);
+	for (size_t i = 0; i < blocks.size(); i++)
+		block_at[blocks[i].first] = i;
+
+	counters.assign(blocks.size(), 0);
+	dispatch = std::make_unique<std::atomic<fragment_fn_t>[]>(blocks.size());
+	for (size_t i = 0; i < blocks.size(); i++)
+		dispatch[i].store(nullptr, std::memory_order_relaxed);
+
+	compiler = std::thread(&vm_tiered::compile_loop, this);
+}
+
+vm_tiered::~vm_tiered()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	compiler.join();
+}
+
+void vm_tiered::run(cpu_state_t* state)
+{
+	size_t count = handlers.size();
+
+	interpreter.state = *state;
+	interpreter.reset();
+
+	while (interpreter.next < count)
+	{
+		size_t block = block_at[interpreter.next];
+		if (block != SIZE_MAX)
+		{
+			fragment_fn_t fragment = dispatch[block].load(std::memory_order_acquire);
+			if (fragment)
+			{
+				interpreter.next = blocks[block].first + fragment(interpreter.stack, &interpreter.vsp, interpreter.vregs, &interpreter.state);
+				continue;
+			}
+
+			if (++counters[block] == threshold)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					queue.push_back(block);
+				}
+				wake.notify_one();
+			}
+		}
+
+		size_t i = interpreter.next;
+		interpreter.begin(i);
+		if (interpreter.step(i))
+			interpreter.jump(i + 1);
+	}
+
+	interpreter.lift_exit();
+	*state = interpreter.state;
+}
+
+// one session for the lifetime of the engine, every block gets its own module so it can be handed to the jit alone
+void vm_tiered::compile_loop()
+{
+	lift_session session;
+	session.context.setDiscardValueNames(true);
+	session.image = image;
+
+	for (;;)
+	{
+		size_t block;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || !queue.empty(); });
+			if (stopping)
+				return;
+
+			block = queue.front();
+			queue.pop_front();
+		}
+
+		vm_lifter lifter(session, handlers);
+		std::string name = "vm_block_" + std::to_string(blocks[block].first);
+		lifter.lift_block(blocks[block], name);
+		session.optimize(*lifter.module, OptimizationLevel::O2);
+
+		void* code = jit.add(*lifter.module, name);
+		if (!code)
+			continue;
+
+		dispatch[block].store((fragment_fn_t)code, std::memory_order_release);
+		compiled_count.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void benchmark_tiered(const image_memory_t& image, const vm_program& handlers, int iterations, uint32_t threshold)
+{
+	// run counts the cumulative times are sampled at
+	std::vector<int> checkpoints;
+	for (int runs = 1; runs < iterations; runs *= 10)
+		checkpoints.push_back(runs);
+	checkpoints.push_back(iterations);
+
+	auto measure = [&](auto&& setup_ms, auto&& run) {
+		std::vector<double> totals;
+		double elapsed = setup_ms;
+		utils::stopwatch_t timer;
+		for (int i = 1; i <= iterations; i++)
+		{
+			run();
+			if (i == checkpoints[totals.size()])
+				totals.push_back(elapsed + timer.elapsed_ms());
+		}
+		return totals;
+	};
+
+	// every run starts from the same context, and an engine whose result differs from the interpreter's is not
+	// timed. the tiered engine is checked once more after its last run, when its hot blocks are compiled
+	const cpu_state_t initial = {};
+	const cpu_state_t expected = vm_interpreter::reference(handlers, initial);
+
+	vm_interpreter interpreter(handlers);
+	std::vector<double> interpreted = measure(0.0, [&] { interpreter.state = initial; interpreter.run(); });
+
+	cpu_state_t state = initial;
+	vm_tiered tiered(&image, handlers, threshold);
+	tiered.run(&state);
+	if (!vm_interpreter::check(expected, state, "tiered"))
+		return;
+
+	std::vector<double> tiers = measure(0.0, [&] { state = initial; tiered.run(&state); });
+	if (!vm_interpreter::check(expected, state, "tiered after compiling hot blocks"))
+		return;
+
+	// the whole routine up front, lifting and O3 included
+	utils::stopwatch_t compile_timer;
+	lift_session session;
+	session.context.setDiscardValueNames(true);
+	session.image = &image;
+	vm_lifter lifter(session, handlers);
+	lifter.lift();
+	lifter.optimizeLLVM(OptimizationLevel::O3);
+	vm_jit jit;
+	if (!jit.compile(*lifter.module))
+		return;
+	double compile_ms = compile_timer.elapsed_ms();
+
+	state = initial;
+	jit.entry(&state);
+	if (!vm_interpreter::check(expected, state, "O3 + ORC"))
+		return;
+	std::vector<double> compiled = measure(compile_ms, [&] { state = initial; jit.entry(&state); });
+
+	outs() << "[+] cumulative ms     interpreter     tiered (" << threshold << ")     O3 + ORC\n";
+	std::optional<int> tiered_crossover, compiled_crossover;
+	for (size_t i = 0; i < checkpoints.size(); i++)
+	{
+		outs() << "    " << format("%-10d %14.3f %14.3f %14.3f", checkpoints[i], interpreted[i], tiers[i], compiled[i]) << "\n";
+		if (!tiered_crossover && tiers[i] < interpreted[i])
+			tiered_crossover = checkpoints[i];
+		if (!compiled_crossover && compiled[i] < interpreted[i])
+			compiled_crossover = checkpoints[i];
+	}
+
+	outs() << "[+] " << tiered.compiled() << " of " << split_blocks(handlers).size() << " blocks compiled\n";
+	if (tiered_crossover)
+		outs() << "[+] tiered overtakes the interpreter by " << *tiered_crossover << " runs\n";
+	if (compiled_crossover)
+		outs() << "[+] O3 + ORC overtakes the interpreter by " << *compiled_crossover << " runs\n";
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "vm.hpp"
+#include "jit.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+// compiled vm_block_t, same arguments as lift_session::fragment_t, returns the next handler relative to the block
+using fragment_fn_t = int32_t(*)(uint8_t* vstack, uint8_t** vsp, uint64_t* vregs, cpu_state_t* state);
+
+// interprets the handlers and counts entries per VM block; a block that reaches the threshold is lifted with
+// lift_block and compiled through ORC on a background thread, later entries call it through the dispatch table
+class vm_tiered
+{
+public:
+	vm_tiered(const image_memory_t* image_, const vm_program& handlers_, uint32_t threshold_);
+	~vm_tiered();
+
+	void run(cpu_state_t* state);
+	size_t compiled() const { return compiled_count.load(std::memory_order_relaxed); }
+
+private:
+	const image_memory_t* image;
+	const vm_program handlers;
+	uint32_t threshold;
+
+	vm_interpreter interpreter;
+	std::vector<vm_block_t> blocks;
+	std::vector<size_t> block_at;	// handler index to the block it starts, SIZE_MAX inside a block
+	std::vector<uint32_t> counters;
+	std::unique_ptr<std::atomic<fragment_fn_t>[]> dispatch;
+	std::atomic<size_t> compiled_count = 0;
+
+	vm_jit jit;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<size_t> queue;
+	bool stopping = false;
+	std::thread compiler;
+
+	void compile_loop();
+};
+
+// cumulative time of the interpreter, the tiered engine and O3 + ORC over growing run counts
+void benchmark_tiered(const image_memory_t& image, const vm_program& handlers, int iterations, uint32_t threshold);
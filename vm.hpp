@@ -8,6 +8,12 @@
 
 #include <stdint.h>
 #include <vector>
+#include <array>
+#include <string_view>
+#include <map>
+#include <chrono>
+#include <optional>
+#include <iterator>
 
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
@@ -21,10 +27,16 @@
 #include <llvm/Transforms/Scalar/SimplifyCFG.h>
 #include <llvm/Transforms/InstCombine/InstCombine.h>
 #include "llvm/Support/FileSystem.h"
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include "llvm/Support/raw_ostream.h"
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Linker/Linker.h>
 
 #include "binary.hpp"
+#include "image.hpp"
 
 #include <vtil/vtil>
 
@@ -53,9 +65,180 @@ enum v_opcode_t
 	OR_32,
 	AND_32,
 	XOR_32,
-	JNZ
+	JNZ,
+	CALL_NATIVE,
+	CALL_IMPORT,
+	OPCODE_COUNT
 };
 
+enum v_operand_t : uint8_t
+{
+	OPERAND_NONE,
+	OPERAND_VREG,
+	OPERAND_IMM,
+	OPERAND_TARGET
+};
+
+enum v_flags_t : uint8_t
+{
+	FLAGS_NONE,
+	FLAGS_PUSH_ZF,	// pushes the sign-extended zero flag of the result as a 64-bit value
+	FLAGS_POP_ZF
+};
+
+enum v_alu_t : uint8_t
+{
+	ALU_NONE,
+	ALU_ADD,
+	ALU_SUB,
+	ALU_OR,
+	ALU_AND,
+	ALU_XOR
+};
+
+struct opcode_desc_t
+{
+	v_opcode_t opcode;
+	std::string_view name;
+	uint64_t handler;		// native handler address in input.exe, 0 when it is not decoded from one
+	uint8_t width;			// width in bits of the value the handler works on
+	v_operand_t operand;
+	int16_t stack_effect;	// vsp delta in bytes, POP_VSP replaces vsp instead
+	v_flags_t flags;
+	v_alu_t alu;
+};
+
+constexpr std::array<opcode_desc_t, OPCODE_COUNT> opcode_table =
+{ {
+	{ UNKNOWN,		"UNKNOWN",		0,				0,	OPERAND_NONE,	0,		FLAGS_NONE,		ALU_NONE },
+	{ VM_INIT,		"VM_INIT",		0,				64,	OPERAND_IMM,	-136,	FLAGS_NONE,		ALU_NONE },
+	{ VM_EXIT,		"VM_EXIT",		0,				64,	OPERAND_NONE,	136,	FLAGS_NONE,		ALU_NONE },
+	{ POP_VR64,		"POP_VR64",		0x140016101,	64,	OPERAND_VREG,	8,		FLAGS_NONE,		ALU_NONE },
+	{ POP_VR32,		"POP_VR32",		0x140016126,	32,	OPERAND_VREG,	4,		FLAGS_NONE,		ALU_NONE },
+	{ PUSH_VR64,	"PUSH_VR64",	0x14001606a,	64,	OPERAND_VREG,	-8,		FLAGS_NONE,		ALU_NONE },
+	{ PUSH_VR32,	"PUSH_VR32",	0x140016090,	32,	OPERAND_VREG,	-4,		FLAGS_NONE,		ALU_NONE },
+	{ PUSH_VSP,		"PUSH_vsp",		0x14001620a,	64,	OPERAND_NONE,	-8,		FLAGS_NONE,		ALU_NONE },
+	{ POP_VSP,		"POP_vsp",		0x14001626c,	64,	OPERAND_NONE,	8,		FLAGS_NONE,		ALU_NONE },
+	{ PUSH_64,		"PUSH_64",		0x140016194,	64,	OPERAND_IMM,	-8,		FLAGS_NONE,		ALU_NONE },
+	{ PUSH_32,		"PUSH_32",		0x1400161b1,	32,	OPERAND_IMM,	-4,		FLAGS_NONE,		ALU_NONE },
+	{ SUB64,		"SUB64",		0x14001631f,	64,	OPERAND_NONE,	0,		FLAGS_PUSH_ZF,	ALU_SUB },
+	{ SUB32,		"SUB32",		0x140016337,	32,	OPERAND_NONE,	-4,		FLAGS_PUSH_ZF,	ALU_SUB },
+	{ ADD64,		"ADD64",		0x1400162B1,	64,	OPERAND_NONE,	0,		FLAGS_PUSH_ZF,	ALU_ADD },
+	{ ADD32,		"ADD32",		0x1400162C9,	32,	OPERAND_NONE,	-4,		FLAGS_PUSH_ZF,	ALU_ADD },
+	{ WRITE32,		"WRITE32",		0x140016707,	32,	OPERAND_NONE,	12,		FLAGS_NONE,		ALU_NONE },
+	{ LOAD32,		"LOAD32",		0x14001669F,	32,	OPERAND_NONE,	4,		FLAGS_NONE,		ALU_NONE },
+	{ LOAD64,		"LOAD64",		0x140016689,	64,	OPERAND_NONE,	0,		FLAGS_NONE,		ALU_NONE },
+	{ OR_32,		"OR_32",		0x140016481,	32,	OPERAND_NONE,	-4,		FLAGS_PUSH_ZF,	ALU_OR },
+	{ AND_32,		"AND_32",		0x140016413,	32,	OPERAND_NONE,	-4,		FLAGS_PUSH_ZF,	ALU_AND },
+	{ XOR_32,		"XOR_32",		0x1400163a5,	32,	OPERAND_NONE,	-4,		FLAGS_PUSH_ZF,	ALU_XOR },
+	{ JNZ,			"JNZ",			0x14001676b,	64,	OPERAND_TARGET,	8,		FLAGS_POP_ZF,	ALU_NONE },
+	// native code between a VM exit and the next entry, data is the callee or the IAT slot holding it
+	{ CALL_NATIVE,	"CALL_NATIVE",	0,				64,	OPERAND_IMM,	0,		FLAGS_NONE,		ALU_NONE },
+	{ CALL_IMPORT,	"CALL_IMPORT",	0,				64,	OPERAND_IMM,	0,		FLAGS_NONE,		ALU_NONE }
+} };
+
+// native context slots, gpr[] follows the x86 register encoding
+enum v_context_t : uint8_t
+{
+	CTX_RAX,
+	CTX_RCX,
+	CTX_RDX,
+	CTX_RBX,
+	CTX_RSP,
+	CTX_RBP,
+	CTX_RSI,
+	CTX_RDI,
+	CTX_R8,
+	CTX_R9,
+	CTX_R10,
+	CTX_R11,
+	CTX_R12,
+	CTX_R13,
+	CTX_R14,
+	CTX_R15,
+	CTX_RFLAGS,
+	CTX_COUNT
+};
+
+constexpr std::array<std::string_view, CTX_COUNT> context_names =
+{
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rflags"
+};
+
+// order in which VM_INIT pushes the gprs after the key, VM_EXIT pops them in reverse after rflags. rsp is never saved
+constexpr std::array<v_context_t, 15> vm_context_order =
+{
+	CTX_R15, CTX_R14, CTX_R13, CTX_R12, CTX_R11, CTX_R10, CTX_R9, CTX_R8,
+	CTX_RBP, CTX_RDI, CTX_RSI, CTX_RDX, CTX_RCX, CTX_RBX, CTX_RAX
+};
+
+// what devirtualized takes instead of live registers, laid out as { [16 x i64], i64 } so sroa can split it
+struct cpu_state_t
+{
+	uint64_t gpr[16];
+	uint64_t rflags;
+
+	uint64_t& operator[](v_context_t reg) { return reg == CTX_RFLAGS ? rflags : gpr[reg]; }
+};
+
+constexpr bool opcode_table_is_indexed()
+{
+	for (size_t i = 0; i < opcode_table.size(); i++)
+	{
+		if (opcode_table[i].opcode != i)
+			return false;
+	}
+	return true;
+}
+static_assert(opcode_table_is_indexed(), "opcode_table must be ordered like v_opcode_t");
+
+constexpr const opcode_desc_t& describe(v_opcode_t opcode)
+{
+	return opcode < OPCODE_COUNT ? opcode_table[opcode] : opcode_table[UNKNOWN];
+}
+
+// handler addresses sorted at compile time so decoding is a binary search over a flat array
+constexpr size_t handler_count()
+{
+	size_t count = 0;
+	for (const opcode_desc_t& desc : opcode_table)
+		count += desc.handler != 0;
+	return count;
+}
+
+constexpr auto handler_table = []()
+{
+	std::array<std::pair<uint64_t, v_opcode_t>, handler_count()> table = {};
+	size_t count = 0;
+	for (const opcode_desc_t& desc : opcode_table)
+	{
+		if (desc.handler == 0)
+			continue;
+
+		size_t j = count++;
+		for (; j > 0 && table[j - 1].first > desc.handler; j--)
+			table[j] = table[j - 1];
+		table[j] = { desc.handler, desc.opcode };
+	}
+	return table;
+}();
+
+constexpr v_opcode_t opcode_from_handler(uint64_t address)
+{
+	size_t low = 0, high = handler_table.size();
+	while (low < high)
+	{
+		size_t mid = (low + high) / 2;
+		if (handler_table[mid].first < address)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low < handler_table.size() && handler_table[low].first == address ? handler_table[low].second : UNKNOWN;
+}
+static_assert(opcode_from_handler(0x14001676b) == JNZ && opcode_from_handler(0x140016101) == POP_VR64);
+
 class handler_t
 {
 public:
@@ -64,55 +247,121 @@ public:
 	uint32_t address;
 	uint32_t next_handler;
 	int instr_size;
-	llvm::BasicBlock* block;
-	vtil::basic_block* vblock = nullptr;
 
-	std::string parseToStr()
+	const opcode_desc_t& desc() const
 	{
-		static const std::unordered_map<v_opcode_t, std::string> opcode_map =
-		{
-			{UNKNOWN, "UNKNOWN"},
-			{VM_INIT, "VM_INIT"},
-			{VM_EXIT, "VM_EXIT"},
-			{POP_VR64, "POP_VR64"},
-			{PUSH_VR64, "PUSH_VR64"},
-			{PUSH_VSP, "PUSH_vsp"},
-			{POP_VSP, "POP_vsp"},
-			{PUSH_64, "PUSH_64"},
-			{SUB64, "SUB64"},
-			{ADD64, "ADD64"},
-			{PUSH_VR32, "PUSH_VR32"},
-			{WRITE32, "WRITE32"},
-			{PUSH_32, "PUSH_32"},
-			{LOAD32, "LOAD32"},
-			{LOAD64, "LOAD64"},
-			{OR_32, "OR_32"},
-			{AND_32, "AND_32"},
-			{ADD32, "ADD32"},
-			{SUB32, "SUB32"},
-			{XOR_32, "XOR_32"},
-			{POP_VR32, "POP_VR32"},
-			{JNZ, "JNZ"}
-		};
-
-		auto it = opcode_map.find(opcode);
-		return it != opcode_map.end() ? it->second : "UNHANDLED_OPCODE";
+		return describe(opcode);
+	}
+
+	std::string_view parseToStr() const
+	{
+		return describe(opcode).name;
 	}
 };
 
+struct program_columns_t;
+
+// the decoded handlers as every backend reads them: a view over the decoder's vector or over the columns of a
+// mapped program file (program_file.hpp). handlers come out by value, so lift_core cannot tell the two apart
+class vm_program
+{
+public:
+	vm_program() = default;
+	vm_program(const std::vector<handler_t>& handlers_) : rows(handlers_.data()), count(handlers_.size()) {}
+	vm_program(const program_columns_t* columns_, size_t count_) : columns(columns_), count(count_) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	handler_t operator[](size_t index) const { return rows ? rows[index] : load_column(index); }
+	handler_t back() const { return (*this)[count - 1]; }
+
+	// the mapped columns, nullptr for a view over the decoder's vector
+	const program_columns_t* mapped() const { return columns; }
+
+	class iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = handler_t;
+		using difference_type = ptrdiff_t;
+		using pointer = void;
+		using reference = handler_t;
+
+		iterator(const vm_program* program_, size_t index_) : program(program_), index(index_) {}
+
+		handler_t operator*() const { return (*program)[index]; }
+		iterator& operator++() { index++; return *this; }
+		iterator operator++(int) { iterator old = *this; index++; return old; }
+		bool operator==(const iterator& other) const { return index == other.index; }
+		bool operator!=(const iterator& other) const { return index != other.index; }
+
+	private:
+		const vm_program* program;
+		size_t index;
+	};
+
+	iterator begin() const { return iterator(this, 0); }
+	iterator end() const { return iterator(this, count); }
+
+private:
+	const handler_t* rows = nullptr;
+	const program_columns_t* columns = nullptr;
+	size_t count = 0;
+
+	handler_t load_column(size_t index) const;
+};
+
+#include "lift_core.hpp"
+
+// a run of handlers only entered at its first one, entry_height is the vstack depth in bytes when every path agrees on it
+struct vm_block_t
+{
+	size_t first;
+	size_t last;
+	std::optional<int64_t> entry_height;
+};
+
+std::vector<vm_block_t> split_blocks(const vm_program& handlers);
+
 using namespace vtil;
-class vtil_lifter
+class vtil_lifter : public lift_core<vtil_lifter>
 {
 public:
-	vtil_lifter(std::vector<handler_t> handlers_);
+	vtil_lifter(const vm_program& handlers_);
+	~vtil_lifter();
 	routine* rtn = new routine(vtil::architecture_amd64);
-	std::vector<handler_t> handlers;
+	const vm_program handlers;
 	void lift();
+
+	// lift_core primitives
+	void begin(size_t index);
+	void jump(size_t index);
+	void branch_nz(const operand& flag, size_t taken, size_t not_taken);
+	void push(const operand& value, int width);
+	operand pop(int width);
+	operand imm(uint64_t value, int width);
+	operand read_vreg(uint64_t index, int width);
+	void write_vreg(uint64_t index, const operand& value, int width);
+	operand read_vsp();
+	void write_vsp(const operand& value);
+	operand load(const operand& address, int width);
+	void store(const operand& address, const operand& value, int width);
+	operand alu(v_alu_t kind, const operand& lhs, const operand& rhs, int width);
+	operand zero_flag(const operand& result, int width);
+	operand read_context(v_context_t reg);
+	void write_context(v_context_t reg, const operand& value);
+	void call(const operand& target);
+	void exit_to(const operand& target) {}
+	void vm_exit();
+
 private:
-	vip_t vip = 0;
 	basic_block* block = nullptr;
+	basic_block* exit_block = nullptr;
+	std::vector<basic_block*> handler_blocks;	// indexed like handlers, the decoded program itself stays read-only
 
-	void vm_entry();
+	vip_t vip_of(size_t index);
+	basic_block*& block_of(size_t index);
+	void link(size_t index);
 
 	std::vector<register_desc> vregs;
 	std::unordered_map<int, register_desc> pregs = {
@@ -135,62 +384,194 @@ private:
 	};
 };
 
-class vm_lifter {
+struct output_options_t
+{
+	bool dump = false;
+	bool emit_text = false;
+	bool emit_bitcode = true;
+	bool vtil_compact = false;	// output.vtilc through vtil_stream_writer instead of save_routine output.vtil
+	bool stats = false;			// time and instruction counts of every stage on stdout
+};
+
+class lift_session;
+class artifact_cache;
+
+// folds loads from constant addresses inside read-only sections of the input image
+class image_fold_pass : public llvm::PassInfoMixin<image_fold_pass>
+{
+public:
+	image_fold_pass(const lift_session* session_) : session(session_) {}
+	llvm::PreservedAnalyses run(llvm::Function& function, llvm::FunctionAnalysisManager& FAM);
+
+private:
+	const lift_session* session;
+};
+
+// state that outlives a single routine: the context, cached types, the pass builder,
+// the analysis managers and one pipeline per optimization level
+class lift_session
+{
+public:
+	LLVMContext context;
+	const image_memory_t* image = nullptr;
+
+	IntegerType* i8_t;
+	IntegerType* i32_t;
+	IntegerType* i64_t;
+	ArrayType* vstack_t;
+	StructType* state_t;		// cpu_state_t
+	FunctionType* devirtualized_t;	// void (ptr state)
+	FunctionType* fragment_t;	// i32 (ptr vstack, ptr vsp, ptr vregs, ptr state), returns the next handler relative to the block's first
+
+	lift_session();
+
+	std::unique_ptr<Module> create_module();
+	void optimize(Module& module, OptimizationLevel level);
+
+private:
+	PassBuilder PB;
+	LoopAnalysisManager LAM;
+	FunctionAnalysisManager FAM;
+	CGSCCAnalysisManager CGAM;
+	ModuleAnalysisManager MAM;
+
+	std::vector<std::pair<OptimizationLevel, ModulePassManager>> pipelines;
+};
+
+class vm_lifter : public lift_core<vm_lifter> {
 public:
 
+	lift_session& session;
 	LLVMContext& context;
 	IRBuilder<> builder;
-	Module* module;
+	std::unique_ptr<Module> module;
 	Function* function;
 
-	std::vector<handler_t> handlers;
+	const vm_program handlers;
 
 	std::vector<llvm::Value*> vregs = std::vector<llvm::Value*>(32);
 	llvm::Value* rsp;
 	llvm::Value* vsp;
+
+	output_options_t output;
+	unsigned threads = 1;
+	artifact_cache* fragment_cache = nullptr;	// liftToLLVM lifts through lift_parallel and reuses unchanged blocks
 
-	vm_lifter(LLVMContext& ctx, std::vector<handler_t> handlers_);
-	void liftToLLVM();
+	// vtil pass order (empty for all of them) and time budget, liftToVTIL leaves the pass report in vtil_report
+	std::vector<std::string> vtil_passes;
+	double vtil_budget_ms = 0;
+	std::string vtil_report;
+
+	vm_lifter(lift_session& session_, const vm_program& handlers_);
+	void lift();
+	void lift_parallel(unsigned thread_count, artifact_cache* cache = nullptr);
+	Function* lift_block(const vm_block_t& block, const std::string& name);
+	bool liftToLLVM();	// false when the optimized function does not verify, nothing is written then
+	bool loadLLVM(llvm::StringRef bitcode);	// an already optimized module instead of lifting, outputs as liftToLLVM
 	void optimizeLLVM(llvm::OptimizationLevel level);
 
+	// independent of liftToLLVM, the two can run on separate threads
 	void liftToVTIL();
+	void dumpVTIL();
+
+	// lift_core primitives
+	void begin(size_t index);
+	void jump(size_t index);
+	void branch_nz(llvm::Value* flag, size_t taken, size_t not_taken);
+	void push(llvm::Value* value, int width);
+	llvm::Value* pop(int width);
+	llvm::Value* imm(uint64_t value, int width);
+	llvm::Value* read_vreg(uint64_t index, int width);
+	void write_vreg(uint64_t index, llvm::Value* value, int width);
+	llvm::Value* read_vsp();
+	void write_vsp(llvm::Value* value);
+	llvm::Value* load(llvm::Value* address, int width);
+	void store(llvm::Value* address, llvm::Value* value, int width);
+	llvm::Value* alu(v_alu_t kind, llvm::Value* lhs, llvm::Value* rhs, int width);
+	llvm::Value* zero_flag(llvm::Value* result, int width);
+	llvm::Value* read_context(v_context_t reg);
+	void write_context(v_context_t reg, llvm::Value* value);
+	void call(llvm::Value* target);
+	void exit_to(llvm::Value* target) {}
+	void vm_exit();
 
 private:
-	vtil_lifter* vtil_;
-	llvm::Value* calc_zero_flag(llvm::Value* result);
+	std::unique_ptr<vtil_lifter> vtil_;
+	void emitLLVM();
+	BasicBlock* exit_block = nullptr;
+	std::vector<BasicBlock*> handler_blocks;	// indexed like handlers, several lifters can share one decoded program
+	BasicBlock* block_of(size_t index);
 
-	void vm_init();
-	void vm_exit();
-	void pop_vr64(handler_t handler);
-	void pop_vr32(handler_t handler);
-	void push_vr64(handler_t handler);
-	void push_vr32(handler_t handler);
-	void push_vsp();
-	void pop_vsp();
-	void push_64(handler_t handler);
-	void push_32(handler_t handler);
-	void sub_64(handler_t handler);
-	void sub_32(handler_t handler);
-	void add_64(handler_t handler);
-	void add_32();
-	void write_32();
-	void load_32();
-	void load_64();
-	void or_32();
-	void and_32();
-	void xor_32();
-	llvm::Value* jnz();
+	// while lifting a block fragment, vsp and vregs enter and leave through the fragment arguments
+	bool in_fragment = false;
+	size_t fragment_first = 0;
+	size_t fragment_last = 0;
+	llvm::Value* vsp_state = nullptr;
+	llvm::Value* vregs_state = nullptr;
+
+	// the cpu_state_t argument of devirtualized or of the fragment
+	llvm::Value* context_state = nullptr;
+	void create_devirtualized();
+	llvm::Value* context_slot(v_context_t reg);
+	uint32_t dirty_vregs = 0;
+
+	bool leaves_fragment(size_t index) const { return in_fragment && (index < fragment_first || index >= fragment_last); }
+	void leave_fragment(llvm::Value* next);
+	void reset_vstack_tracking();
+
+	// jnz targets, reached from more than their program-order predecessor. the serial lift carries the slot
+	// tracking along program order, so it forgets the slots at each of these
+	std::vector<bool> merge_points;
+
+	// vstack and guest memory live in disjoint alias scopes as long as vsp points into vstack_memory
+	llvm::Value* vstack_memory = nullptr;
+	MDNode* vstack_scope;
+	MDNode* guest_scope;
+	bool vsp_in_guest = false;
+	bool vstack_escaped = false;
+
+	// escape is also followed in program order, a back-edge can run a guest access lifted before the first
+	// escape after it. lift() drops the scopes of those once the whole function is lifted
+	size_t current_index = 0;
+	std::optional<size_t> first_escape;
+	std::vector<std::pair<llvm::Instruction*, size_t>> early_guest_accesses;
+	void mark_escaped();
+	void untag_after_escape();
+
+	struct vstack_slot_t
+	{
+		llvm::Value* value;
+		int64_t size;
+	};
+
+	std::map<int64_t, vstack_slot_t> vstack_slots;
+	bool vstack_slots_complete = true;	// false once slots were forgotten, an untracked offset then holds anything
+	std::unordered_map<llvm::Value*, llvm::Value*> popped_values;
+	SmallPtrSet<llvm::Value*, 32> untracked_pops;
+	std::unordered_map<llvm::Value*, int64_t> vsp_bases;
+
+	std::optional<int64_t> vstack_offset(llvm::Value* pointer);
+	std::optional<int64_t> vstack_address(llvm::Value* value, int depth = 0);
+	bool is_vstack_derived(llvm::Value* value, int depth = 0);
+	std::optional<uint64_t> resolve_constant(llvm::Value* value, int depth = 0);
+	std::optional<uint64_t> fold_image_load(llvm::Value* address, int size);
+
+	void tag_vstack_access(llvm::Instruction* access);
+	void tag_guest_access(llvm::Instruction* access, llvm::Value* address);
+	void on_vstack_store(llvm::StoreInst* store, llvm::Value* value);
+	void on_vstack_load(llvm::LoadInst* load);
 
 	void vpush64(Value* val) {
 		vsp = builder.CreateGEP(builder.getInt8Ty(), vsp,
 			ConstantInt::get(builder.getInt64Ty(), -8), "vsp_dec64");
 		Value* ptr64 = builder.CreatePointerCast(vsp, builder.getInt64Ty()->getPointerTo(), "ptr64");
-		builder.CreateStore(val, ptr64);
+		on_vstack_store(builder.CreateStore(val, ptr64), val);
 	}
 
 	Value* vpop64() {
 		Value* ptr64 = builder.CreatePointerCast(vsp, builder.getInt64Ty()->getPointerTo(), "ptr64");
-		Value* ret = builder.CreateLoad(builder.getInt64Ty(), ptr64);
+		LoadInst* ret = builder.CreateLoad(builder.getInt64Ty(), ptr64);
+		on_vstack_load(ret);
 		vsp = builder.CreateGEP(builder.getInt8Ty(), vsp,
 			ConstantInt::get(builder.getInt64Ty(), 8), "vsp_inc64");
 		return ret;
@@ -201,12 +582,13 @@ private:
 			ConstantInt::get(builder.getInt64Ty(), -4), "vsp_dec32");
 		Value* truncVal = builder.CreateTrunc(val, builder.getInt32Ty(), "trunc32");
 		Value* ptr32 = builder.CreatePointerCast(vsp, builder.getInt32Ty()->getPointerTo(), "ptr32");
-		builder.CreateStore(truncVal, ptr32);
+		on_vstack_store(builder.CreateStore(truncVal, ptr32), val);
 	}
 
 	Value* vpop32() {
 		Value* ptr32 = builder.CreatePointerCast(vsp, builder.getInt32Ty()->getPointerTo(), "ptr32");
-		Value* ret = builder.CreateLoad(builder.getInt32Ty(), ptr32);
+		LoadInst* ret = builder.CreateLoad(builder.getInt32Ty(), ptr32);
+		on_vstack_load(ret);
 		vsp = builder.CreateGEP(builder.getInt8Ty(), vsp,
 			ConstantInt::get(builder.getInt64Ty(), 4), "vsp_inc32");
 		return ret;
@@ -227,57 +609,134 @@ private:
 	}
 };
 
+// executes the decoded bytecode directly, with the same semantics the lifters give each handler
+class vm_interpreter : public lift_core<vm_interpreter>
+{
+public:
+	vm_interpreter(const vm_program& handlers_);
+	void run();
+
+	// the context one run from initial leaves, what every compiled tier has to reproduce. check prints the first
+	// register a tier got wrong
+	static cpu_state_t reference(const vm_program& handlers, const cpu_state_t& initial);
+	static bool check(const cpu_state_t& expected, const cpu_state_t& actual, const char* tier);
+
+	const vm_program handlers;
+	cpu_state_t state = {};
+	uint64_t vregs[32] = {};
+	size_t next = 0;
+
+	// laid out like the fragment arguments, so the tiered engine can hand them to compiled blocks
+	alignas(16) uint8_t stack[2048];
+	uint8_t* vsp = nullptr;
+
+	void reset() {
+		vsp = stack + sizeof(stack);
+		next = 0;
+	}
+
+	// lift_core primitives
+	void begin(size_t index) {}
+	void jump(size_t index) { next = index; }
+	void branch_nz(uint64_t flag, size_t taken, size_t not_taken) { next = flag != 0 ? taken : not_taken; }
+
+	void push(uint64_t value, int width) {
+		vsp -= width / 8;
+		memcpy(vsp, &value, width / 8);
+	}
+
+	uint64_t pop(int width) {
+		uint64_t value = 0;
+		memcpy(&value, vsp, width / 8);
+		vsp += width / 8;
+		return value;
+	}
+
+	uint64_t imm(uint64_t value, int width) { return truncate(value, width); }
+	uint64_t read_vreg(uint64_t index, int width) { return truncate(vregs[index], width); }
+	void write_vreg(uint64_t index, uint64_t value, int width) { vregs[index] = value; }
+	uint64_t read_vsp() { return (uint64_t)vsp; }
+	void write_vsp(uint64_t value) { vsp = (uint8_t*)value; }
+
+	uint64_t load(uint64_t address, int width) {
+		uint64_t value = 0;
+		memcpy(&value, (void*)address, width / 8);
+		return value;
+	}
+
+	void store(uint64_t address, uint64_t value, int width) {
+		memcpy((void*)address, &value, width / 8);
+	}
+
+	uint64_t alu(v_alu_t kind, uint64_t lhs, uint64_t rhs, int width);
+	uint64_t zero_flag(uint64_t result, int width) { return result == 0 ? ~0ull : 0; }
+	uint64_t read_context(v_context_t reg) { return state[reg]; }
+	void write_context(v_context_t reg, uint64_t value) { state[reg] = value; }
+	void call(uint64_t target);
+	void exit_to(uint64_t target) {}
+	void vm_exit() {}
+
+private:
+	static uint64_t truncate(uint64_t value, int width) {
+		return width == 64 ? value : value & ((1ull << width) - 1);
+	}
+};
+
 namespace utils
 {
-	handler_t analyze_handler(std::vector<native_instruction_t> handler_content)
+	struct stopwatch_t
 	{
-		handler_t handler = {};
-		for (int i = 0; i < handler_content.size(); i++)
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		double elapsed_ms() const
 		{
-			native_instruction_t native_instruction = handler_content[i];
-
-			if (native_instruction.i.mnemonic == ZYDIS_MNEMONIC_ADD && native_instruction.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-				native_instruction.operands[0].reg.value == ZYDIS_REGISTER_R13 && native_instruction.operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE)
-			{
-				handler.instr_size += native_instruction.operands[1].imm.value.s;
-			}
-			else if (native_instruction.i.mnemonic == ZYDIS_MNEMONIC_INC && native_instruction.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-				native_instruction.operands[0].reg.value == ZYDIS_REGISTER_R13)
-			{
-				handler.instr_size++;
-			}
-			else if (native_instruction.i.mnemonic == ZYDIS_MNEMONIC_JMP)
-			{
-				break;
-			}
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 		}
+	};
 
-		static const std::unordered_map<uint64_t, v_opcode_t> opcode_map = {
-			   {0x140016101, POP_VR64},
-			   {0x14001606a, PUSH_VR64},
-			   {0x14001620a, PUSH_VSP},
-			   {0x140016194, PUSH_64},
-			   {0x14001631f, SUB64},
-			   {0x14001626c, POP_VSP},
-			   {0x1400162B1, ADD64},
-			   {0x140016090, PUSH_VR32},
-			   {0x140016707, WRITE32},
-			   {0x1400161b1, PUSH_32},
-			   {0x14001669F, LOAD32},
-			   {0x140016689, LOAD64},
-			   {0x140016481, OR_32},
-			   {0x140016413, AND_32},
-			   {0x1400162C9, ADD32},
-			   {0x140016337, SUB32},
-			   {0x1400163a5, XOR_32},
-			   {0x140016126, POP_VR32},
-			   {0x14001676b, JNZ}
-		};
-
-		auto it = opcode_map.find(handler_content[0].address);
-		if (it != opcode_map.end()) 
-			handler.opcode = it->second;
+	inline size_t count_instructions(const llvm::Module& module)
+	{
+		size_t count = 0;
+		for (const llvm::Function& function : module)
+			count += function.getInstructionCount();
+		return count;
+	}
 
-		return handler;
+	inline void print_handler(std::ostream& stream, const handler_t& handler)
+	{
+		const opcode_desc_t& desc = handler.desc();
+		stream << "0x" << std::hex << handler.address << "  " << desc.name;
+
+		switch (desc.operand)
+		{
+		case OPERAND_VREG:
+			stream << " vr" << std::dec << handler.data;
+			break;
+		case OPERAND_IMM:
+			stream << " 0x" << std::hex << (desc.width == 64 ? handler.data : (uint32_t)handler.data);
+			break;
+		case OPERAND_TARGET:
+			stream << " -> 0x" << std::hex << handler.data;
+			break;
+		default:
+			break;
+		}
+		stream << std::dec << "\n";
+	}
+
+	inline uint64_t evaluate_alu(v_alu_t kind, uint64_t lhs, uint64_t rhs, int width)
+	{
+		uint64_t result = 0;
+		switch (kind)
+		{
+		case ALU_ADD: result = lhs + rhs; break;
+		case ALU_SUB: result = lhs - rhs; break;
+		case ALU_OR: result = lhs | rhs; break;
+		case ALU_AND: result = lhs & rhs; break;
+		case ALU_XOR: result = lhs ^ rhs; break;
+		default:
+			crashed("encountered an unknown alu operation");
+		}
+		return width == 64 ? result : result & ((1ull << width) - 1);
 	}
 }
\ No newline at end of file
@@ -1,318 +1,201 @@
 #include "vm.hpp"
+#include "vtil_pipeline.hpp"
+#include "vtil_stream.hpp"
+#include <fstream>
+#include <sstream>
 #pragma optimize("", off)
 
-vtil_lifter::vtil_lifter(std::vector<handler_t> handlers_) :
-	handlers(handlers_)
+vtil_lifter::vtil_lifter(const vm_program& handlers_) :
+	handlers(handlers_), handler_blocks(handlers_.size())
 {
 	for (int i = 0; i < 17; i++) {
 		vregs.emplace_back(register_desc(register_virtual, i, 64));
 	}
 }
 
+vtil_lifter::~vtil_lifter()
+{
+	delete rtn;
+}
+
 #pragma optimize("", off)
 
 void vtil_lifter::lift()
 {
-	block = rtn->create_block(handlers[0].address).first;
-	handlers[0].vblock = block;
+	handler_blocks[0] = rtn->create_block(handlers[0].address).first;
+	lift_all();
+}
+
+vip_t vtil_lifter::vip_of(size_t index)
+{
+	if (index < handlers.size())
+		return handlers[index].address;
+
+	// the exit gets the vip right after the last decoded instruction, the exit handler itself may not advance
+	const handler_t& last = handlers.back();
+	return last.address + std::max(last.instr_size, 1);
+}
+
+basic_block*& vtil_lifter::block_of(size_t index)
+{
+	return index < handlers.size() ? handler_blocks[index] : exit_block;
+}
+
+void vtil_lifter::link(size_t index)
+{
+	// fork links an already explored vip as well, but only returns the block when it creates it
+	if (basic_block* forked = block->fork(vip_of(index)))
+		block_of(index) = forked;
+}
+
+void vtil_lifter::begin(size_t index)
+{
+	block = block_of(index);
+	if (block == nullptr)
+	{
+		crashed("block is not created for " << (index < handlers.size() ? handlers[index].parseToStr() : "VM_EXIT") << ":" << index);
+	}
+}
+
+void vtil_lifter::jump(size_t index)
+{
+	block->jmp(vip_of(index));
+	link(index);
+}
+
+void vtil_lifter::branch_nz(const operand& flag, size_t taken, size_t not_taken)
+{
+	block->tne(REG_FLAGS, flag, 0);
+	block->js(REG_FLAGS, vip_of(taken), vip_of(not_taken));
+	link(taken);
+	link(not_taken);
+}
+
+void vtil_lifter::push(const operand& value, int width)
+{
+	block->push(value);
+}
+
+operand vtil_lifter::pop(int width)
+{
+	auto tmp_reg = block->tmp(width);
+	block->pop(tmp_reg);
+	return tmp_reg;
+}
+
+// narrow values stay narrow operands, push and pop move exactly their width relative to $sp
+operand vtil_lifter::imm(uint64_t value, int width)
+{
+	return operand(width == 64 ? value : (uint32_t)value, width);
+}
+
+operand vtil_lifter::read_vreg(uint64_t index, int width)
+{
+	return vregs[index].select(width, 0);
+}
+
+// mov zero extends, like the other backends writing the whole slot
+void vtil_lifter::write_vreg(uint64_t index, const operand& value, int width)
+{
+	block->mov(vregs[index], value);
+}
+
+operand vtil_lifter::read_vsp()
+{
+	return vtil::REG_SP;
+}
+
+void vtil_lifter::write_vsp(const operand& value)
+{
+	block->mov(vtil::REG_SP, value);
+}
 
-	for (int i = 0; i < handlers.size(); i++)
+operand vtil_lifter::load(const operand& address, int width)
+{
+	auto tmp_reg = block->tmp(width);
+	block->ldd(tmp_reg, address, 0);
+	return tmp_reg;
+}
+
+void vtil_lifter::store(const operand& address, const operand& value, int width)
+{
+	block->str(address, 0, value);
+}
+
+operand vtil_lifter::alu(v_alu_t kind, const operand& lhs, const operand& rhs, int width)
+{
+	switch (kind)
 	{
-		handler_t instruction = handlers[i];
-		auto handler = [&](auto recurse, handler_t instruction) -> void
-			{
-				if (instruction.vblock == nullptr)
-				{
-					crashed("block is not created for " << instruction.parseToStr() << ":" << i);
-				}
-				block = instruction.vblock;
-
-				switch (instruction.opcode)
-				{
-				case VM_INIT:
-				{
-					block->push(0x1678F);
-					block->push(pregs[X86_REG_R15]);
-					block->push(pregs[X86_REG_R14]);
-					block->push(pregs[X86_REG_R13]);
-					block->push(pregs[X86_REG_R12]);
-					block->push(pregs[X86_REG_R11]);
-					block->push(pregs[X86_REG_R10]);
-					block->push(pregs[X86_REG_R9]);
-					block->push(pregs[X86_REG_R8]);
-					block->push(pregs[X86_REG_RBP]);
-					block->push(pregs[X86_REG_RDI]);
-					block->push(pregs[X86_REG_RSI]);
-					block->push(pregs[X86_REG_RDX]);
-					block->push(pregs[X86_REG_RCX]);
-					block->push(pregs[X86_REG_RBX]);
-					block->push(pregs[X86_REG_RAX]);
-					block->pushf();
-					break;
-				}
-				case POP_VR64:
-				{
-					block->pop(vregs[instruction.data]);
-					break;
-				}
-				case POP_VR32:
-				{
-					auto tmp_reg = block->tmp(32);
-					block->vpinr(tmp_reg);
-					block->pop(tmp_reg);
-					block->mov(vregs[instruction.data], tmp_reg);
-					break;
-				}
-				case PUSH_VR64:
-				{
-					block->push(vregs[instruction.data]);
-					break;
-				}
-				case PUSH_VR32:
-				{
-					auto tmp_reg = block->tmp(32);
-					block->vpinw(tmp_reg);
-					block->mov(tmp_reg, vregs[instruction.data]);
-					block->push(tmp_reg);
-					break;
-				}
-				case PUSH_VSP:
-				{
-					auto tmp_reg = block->tmp(64);
-					block->push(vtil::REG_SP);
-					break;
-				}
-				case POP_VSP:
-				{
-					block->pop(vtil::REG_SP);
-					break;
-				}
-				case PUSH_64:
-				{
-					block->push(instruction.data);
-					break;
-				}
-				case PUSH_32:
-				{
-					auto tmp_reg = block->tmp(32);
-					block->vpinw(tmp_reg);
-					block->mov(tmp_reg, *(uint32_t*)&instruction.data);
-					block->push(tmp_reg);
-					break;
-				}
-				case SUB64:
-				{
-					auto tmp_reg1 = block->tmp(64);
-					auto tmp_reg2 = block->tmp(64);
-					auto zero_reg = block->tmp(64);
-					block->mov(zero_reg, 0);
-
-					block->pop(tmp_reg1);
-					block->pop(tmp_reg2);
-					block->sub(tmp_reg2, tmp_reg1);
-					block->te(REG_FLAGS, tmp_reg2, zero_reg);
-
-					block->push(tmp_reg2);
-					block->push(vtil::REG_FLAGS);
-					break;
-				}
-				case SUB32:
-				{
-					auto tmp_reg1 = block->tmp(32);
-					auto tmp_reg2 = block->tmp(32);
-					auto zero_reg = block->tmp(64);
-					block->mov(zero_reg, 0);
-
-					block->pop(tmp_reg1);
-					block->pop(tmp_reg2);
-					block->sub(tmp_reg2, tmp_reg1);
-					block->te(REG_FLAGS, tmp_reg2, zero_reg);
-
-					block->push(tmp_reg2);
-					block->push(vtil::REG_FLAGS);
-					break;
-				}
-				case ADD64:
-				{
-					auto tmp_reg1 = block->tmp(64);
-					auto tmp_reg2 = block->tmp(64);
-					auto zero_reg = block->tmp(64);
-					block->mov(zero_reg, 0);
-
-					block->pop(tmp_reg1);
-					block->pop(tmp_reg2);
-					block->add(tmp_reg2, tmp_reg1);
-					block->te(REG_FLAGS, tmp_reg2, zero_reg);
-
-					block->push(tmp_reg2);
-					block->push(vtil::REG_FLAGS);
-					break;
-				}
-				case ADD32:
-				{
-					auto tmp_reg1 = block->tmp(32);
-					auto tmp_reg2 = block->tmp(32);
-					auto zero_reg = block->tmp(64);
-					block->mov(zero_reg, 0);
-
-					block->pop(tmp_reg1);
-					block->pop(tmp_reg2);
-					block->add(tmp_reg2, tmp_reg1);
-					block->te(REG_FLAGS, tmp_reg2, zero_reg);
-
-					block->push(tmp_reg2);
-					block->push(vtil::REG_FLAGS);
-					break;
-				}
-				case WRITE32:
-				{
-					auto tmp_reg1 = block->tmp(64);
-					auto tmp_reg2 = block->tmp(32);
-					block->str(tmp_reg1, 0, tmp_reg2);
-					break;
-				}
-				case LOAD32:
-				{
-					auto tmp_reg1 = block->tmp(64);
-					auto tmp_reg2 = block->tmp(32);
-					block->ldd(tmp_reg2, tmp_reg1, 0);
-					block->push(tmp_reg2);
-					break;
-				}
-				case LOAD64:
-				{
-					auto tmp_reg1 = block->tmp(64);
-					auto tmp_reg2 = block->tmp(64);
-					block->ldd(tmp_reg2, tmp_reg1, 0);
-					block->push(tmp_reg2);
-					break;
-				}
-				case OR_32:
-				{
-					auto tmp_reg1 = block->tmp(32);
-					auto tmp_reg2 = block->tmp(32);
-					auto zero_reg = block->tmp(64);
-					block->mov(zero_reg, 0);
-
-					block->pop(tmp_reg1);
-					block->pop(tmp_reg2);
-					block->bor(tmp_reg2, tmp_reg1);
-					block->te(REG_FLAGS, tmp_reg2, zero_reg);
-
-					block->push(tmp_reg2);
-					block->push(vtil::REG_FLAGS);
-					break;
-				}
-				case AND_32:
-				{
-					auto tmp_reg1 = block->tmp(32);
-					auto tmp_reg2 = block->tmp(32);
-					auto zero_reg = block->tmp(64);
-					block->mov(zero_reg, 0);
-
-					block->pop(tmp_reg1);
-					block->pop(tmp_reg2);
-					block->band(tmp_reg2, tmp_reg1);
-					block->te(REG_FLAGS, tmp_reg2, zero_reg);
-
-					block->push(tmp_reg2);
-					block->push(vtil::REG_FLAGS);
-					break;
-				}
-				case XOR_32:
-				{
-					auto tmp_reg1 = block->tmp(32);
-					auto tmp_reg2 = block->tmp(32);
-					auto zero_reg = block->tmp(64);
-					block->mov(zero_reg, 0);
-
-					block->pop(tmp_reg1);
-					block->pop(tmp_reg2);
-					block->bxor(tmp_reg2, tmp_reg1);
-					block->te(REG_FLAGS, tmp_reg2, zero_reg);
-
-					block->push(tmp_reg2);
-					block->push(vtil::REG_FLAGS);
-					break;
-				}
-				case JNZ:
-				{
-					auto zf = block->tmp(64);
-					block->pop(zf);
-
-					basic_block* target_block = nullptr;
-					for (int j = 0; j < handlers.size(); j++)
-					{
-						if (handlers[j].address == instruction.data)
-						{
-							block->tne(REG_FLAGS, zf, 0);
-							block->js(REG_FLAGS, handlers[j].address, handlers[i+1].address);
-
-							if (handlers[j].vblock == nullptr && !rtn->explored_blocks.contains(handlers[j].address))
-								handlers[j].vblock = block->fork(handlers[j].address);
-							else
-								block->fork(handlers[j].address);
-
-							if (handlers[i + 1].vblock == nullptr)
-								handlers[i + 1].vblock = block->fork(handlers[i + 1].address);
-
-							target_block = handlers[j].vblock;
-							break;
-						}
-					}
-					if (target_block == nullptr)
-					{
-						crashed("couldnt resolve jnz address");
-					}
-
-					return;
-				}
-				default:
-					crashed("encountered an unknown opcode");
-					break;
-				}
-
-				if (i < handlers.size() - 1)
-				{
-					block->jmp(handlers[i + 1].address);
-					if (!rtn->explored_blocks.contains(handlers[i+1].address))
-						handlers[i + 1].vblock = block->fork(handlers[i + 1].address);
-				}
-				else
-				{
-					block->popf();
-					block->pop(pregs[X86_REG_R15]);
-					block->pop(pregs[X86_REG_R14]);
-					block->pop(pregs[X86_REG_R13]);
-					block->pop(pregs[X86_REG_R12]);
-					block->pop(pregs[X86_REG_R11]);
-					block->pop(pregs[X86_REG_R10]);
-					block->pop(pregs[X86_REG_R9]);
-					block->pop(pregs[X86_REG_R8]);
-					block->pop(pregs[X86_REG_RBP]);
-					block->pop(pregs[X86_REG_RDI]);
-					block->pop(pregs[X86_REG_RSI]);
-					block->pop(pregs[X86_REG_RDX]);
-					block->pop(pregs[X86_REG_RCX]);
-					block->pop(pregs[X86_REG_RBX]);
-					block->pop(pregs[X86_REG_RAX]);
-					block->vexit(pregs[X86_REG_RAX]);
-				}
-			};
-		handler(handler, instruction);
+	case ALU_ADD: block->add(lhs, rhs); break;
+	case ALU_SUB: block->sub(lhs, rhs); break;
+	case ALU_OR: block->bor(lhs, rhs); break;
+	case ALU_AND: block->band(lhs, rhs); break;
+	case ALU_XOR: block->bxor(lhs, rhs); break;
+	default:
+		crashed("encountered an unknown alu operation");
 	}
+	return lhs;
+}
+
+operand vtil_lifter::zero_flag(const operand& result, int width)
+{
+	block->te(REG_FLAGS, result, operand(0, width));
+	return vtil::REG_FLAGS;
+}
+
+operand vtil_lifter::read_context(v_context_t reg)
+{
+	static constexpr int physical[] =
+	{
+		X86_REG_RAX, X86_REG_RCX, X86_REG_RDX, X86_REG_RBX, X86_REG_RSP, X86_REG_RBP, X86_REG_RSI, X86_REG_RDI,
+		X86_REG_R8, X86_REG_R9, X86_REG_R10, X86_REG_R11, X86_REG_R12, X86_REG_R13, X86_REG_R14, X86_REG_R15
+	};
+
+	if (reg == CTX_RFLAGS)
+		return vtil::REG_FLAGS;
+	return pregs[physical[reg]];
+}
+
+void vtil_lifter::write_context(v_context_t reg, const operand& value)
+{
+	block->mov(read_context(reg), value);
+}
+
+void vtil_lifter::call(const operand& target)
+{
+	block->vxcall(target);
+}
+
+void vtil_lifter::vm_exit()
+{
+	block->vexit(pregs[X86_REG_RAX]);
 }
 
 void vm_lifter::liftToVTIL()
 {
+	vtil_ = std::make_unique<vtil_lifter>(handlers);
 	vtil_->lift();
-	vtil::optimizer::apply_all(vtil_->rtn);
-	vtil::debug::dump(vtil_->rtn);
-	vtil::save_routine(vtil_->rtn, "output.vtil");
+
+	vtil_pipeline pipeline(vtil_passes);
+	pipeline.budget_ms = vtil_budget_ms;
+	pipeline.run(vtil_->rtn);
+
+	std::ostringstream report;
+	pipeline.report(report);
+	vtil_report = report.str();
+
+	if (output.vtil_compact)
+	{
+		std::ofstream stream("output.vtilc", std::ios::binary);
+		vtil_stream_writer::save(vtil_->rtn, stream);
+	}
+	else
+		vtil::save_routine(vtil_->rtn, "output.vtil");
 }
 
-void vtil_lifter::vm_entry()
+void vm_lifter::dumpVTIL()
 {
-
+	if (vtil_)
+		vtil::debug::dump(vtil_->rtn);
 }
 
@@ -0,0 +1,110 @@
+#include "vtil_pipeline.hpp"
+
+const std::vector<vtil_pipeline::pass_t>& vtil_pipeline::available()
+{
+	static const std::vector<pass_t> passes =
+	{
+		{ "stack_pinning", [](routine* rtn) -> size_t { return optimizer::stack_pinning_pass{}(rtn); } },
+		{ "istack_ref_substitution", [](routine* rtn) -> size_t { return optimizer::istack_ref_substitution_pass{}(rtn); } },
+		{ "bblock_extension", [](routine* rtn) -> size_t { return optimizer::bblock_extension_pass{}(rtn); } },
+		{ "stack_propagation", [](routine* rtn) -> size_t { return optimizer::stack_propagation_pass{}(rtn); } },
+		{ "dead_code_elimination", [](routine* rtn) -> size_t { return optimizer::dead_code_elimination_pass{}(rtn); } },
+		{ "fast_dead_code_elimination", [](routine* rtn) -> size_t { return optimizer::fast_dead_code_elimination_pass{}(rtn); } },
+		{ "mov_propagation", [](routine* rtn) -> size_t { return optimizer::mov_propagation_pass{}(rtn); } },
+		{ "register_renaming", [](routine* rtn) -> size_t { return optimizer::register_renaming_pass{}(rtn); } },
+		{ "symbolic_rewrite", [](routine* rtn) -> size_t { return optimizer::symbolic_rewrite_pass<true>{}(rtn); } },
+		{ "branch_correction", [](routine* rtn) -> size_t { return optimizer::branch_correction_pass{}(rtn); } }
+	};
+	return passes;
+}
+
+const vtil_pipeline::pass_t* vtil_pipeline::find(std::string_view name)
+{
+	for (const pass_t& pass : available())
+	{
+		if (pass.name == name)
+			return &pass;
+	}
+	return nullptr;
+}
+
+vtil_pipeline::vtil_pipeline(const std::vector<std::string>& order)
+{
+	if (order.empty())
+	{
+		for (const pass_t& pass : available())
+			passes.push_back(&pass);
+		return;
+	}
+
+	for (const std::string& name : order)
+	{
+		const pass_t* pass = find(name);
+		if (!pass)
+		{
+			crashed("unknown vtil pass " << name);
+		}
+		passes.push_back(pass);
+	}
+}
+
+void vtil_pipeline::run(routine*& rtn)
+{
+	utils::stopwatch_t timer;
+	routine* best = nullptr;
+	size_t best_count = rtn->num_instructions();
+	input_instructions = best_count;
+
+	for (int round = 0; round < max_rounds && !budget_exceeded; round++)
+	{
+		size_t round_changes = 0;
+		for (const pass_t* pass : passes)
+		{
+			if (budget_ms > 0 && timer.elapsed_ms() >= budget_ms)
+			{
+				budget_exceeded = true;
+				break;
+			}
+
+			size_t before = rtn->num_instructions();
+			utils::stopwatch_t pass_timer;
+			size_t changes = pass->run(rtn);
+			stats.push_back({ pass->name, round, pass_timer.elapsed_ms(), before, rtn->num_instructions(), changes });
+			round_changes += changes;
+
+			// passes leave a valid routine behind, so any point between them is a result worth keeping
+			if (budget_ms > 0 && rtn->num_instructions() < best_count)
+			{
+				delete best;
+				best = rtn->clone();
+				best_count = rtn->num_instructions();
+			}
+		}
+
+		if (round_changes == 0)
+			break;
+	}
+
+	if (best && budget_exceeded && best_count < rtn->num_instructions())
+	{
+		delete rtn;
+		rtn = best;
+	}
+	else
+		delete best;
+
+	output_instructions = rtn->num_instructions();
+}
+
+void vtil_pipeline::report(std::ostream& stream) const
+{
+	double total_ms = 0;
+	for (const stat_t& stat : stats)
+	{
+		stream << "; vtil " << stat.name << " #" << stat.round << ": " << stat.before << " -> " << stat.after
+			<< " instructions, " << stat.changes << " changes in " << stat.ms << " ms\n";
+		total_ms += stat.ms;
+	}
+
+	stream << "; vtil: " << input_instructions << " -> " << output_instructions << " instructions in " << total_ms << " ms" << (budget_exceeded ? ", stopped by the budget" : "") << "\n";
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "vm.hpp"
+
+// the vtil optimizer as an ordered list of passes instead of apply_all. every pass is timed and counted, rounds
+// repeat until nothing changes, and a time budget stops between passes and keeps the smallest routine seen
+class vtil_pipeline
+{
+public:
+	struct pass_t
+	{
+		std::string_view name;
+		size_t (*run)(routine* rtn);	// number of changes
+	};
+
+	struct stat_t
+	{
+		std::string_view name;
+		int round;
+		double ms;
+		size_t before;
+		size_t after;
+		size_t changes;
+	};
+
+	// every pass, in the order collective_cross_pass applies them
+	static const std::vector<pass_t>& available();
+	static const pass_t* find(std::string_view name);
+
+	// empty runs every available pass
+	vtil_pipeline(const std::vector<std::string>& order = {});
+
+	// may replace rtn with the best clone when the budget runs out
+	void run(routine*& rtn);
+	void report(std::ostream& stream) const;
+
+	double budget_ms = 0;	// 0 means no budget
+	int max_rounds = 16;
+
+	std::vector<stat_t> stats;
+	bool budget_exceeded = false;
+	size_t input_instructions = 0;
+	size_t output_instructions = 0;
+
+private:
+	std::vector<const pass_t*> passes;
+};
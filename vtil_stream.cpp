@@ -0,0 +1,291 @@
+#include "vtil_stream.hpp"
+
+vtil_stream_writer::vtil_stream_writer(std::ostream& stream_, architecture_identifier arch)
+	: stream(stream_)
+{
+	stream.write((const char*)&vtil_stream_magic, 4);
+	write_varint(vtil_stream_version);
+	write_varint(arch);
+}
+
+void vtil_stream_writer::write_varint(uint64_t value)
+{
+	uint8_t buffer[10];
+	size_t size = 0;
+	do
+	{
+		buffer[size++] = (uint8_t)(value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+		value >>= 7;
+	} while (value);
+	stream.write((const char*)buffer, size);
+}
+
+// zigzag, so small negative stack offsets stay one byte
+void vtil_stream_writer::write_signed(int64_t value)
+{
+	write_varint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void vtil_stream_writer::write_operand(const operand& op)
+{
+	auto key = op.is_register()
+		? std::make_tuple(true, op.reg().flags, op.reg().combined_id, (uint64_t)op.reg().bit_count, (uint64_t)op.reg().bit_offset)
+		: std::make_tuple(false, op.imm().u64, (uint64_t)op.imm().bit_count, (uint64_t)0, (uint64_t)0);
+
+	auto it = operands.find(key);
+	if (it != operands.end())
+		return write_varint(it->second + 1);
+
+	operands.emplace(key, operands.size());
+	write_varint(0);
+	write_varint(std::get<0>(key));
+	write_varint(std::get<1>(key));
+	write_varint(std::get<2>(key));
+	if (std::get<0>(key))
+	{
+		write_varint(std::get<3>(key));
+		write_varint(std::get<4>(key));
+	}
+}
+
+void vtil_stream_writer::write_block(const basic_block* block)
+{
+	write_varint(1);
+	write_varint(block->entry_vip);
+	write_signed(block->sp_offset);
+	write_varint(block->sp_index);
+	write_varint(block->last_temporary_index);
+
+	write_varint(block->next.size());
+	for (const basic_block* next : block->next)
+		write_varint(next->entry_vip);
+
+	write_varint(block->size());
+	vip_t last_vip = block->entry_vip;
+	for (const instruction& ins : *block)
+	{
+		auto it = names.find(ins.base->name);
+		if (it != names.end())
+			write_varint(it->second + 1);
+		else
+		{
+			names.emplace(ins.base->name, names.size());
+			write_varint(0);
+			write_varint(ins.base->name.size());
+			stream.write(ins.base->name.data(), ins.base->name.size());
+		}
+
+		write_signed(ins.vip - last_vip);
+		write_signed(ins.sp_offset);
+		write_varint(ins.sp_index);
+		write_varint((ins.sp_reset ? 1 : 0) | (ins.explicit_volatile ? 2 : 0));
+		for (const operand& op : ins.operands)
+			write_operand(op);
+
+		if (ins.vip != invalid_vip)
+			last_vip = ins.vip;
+	}
+}
+
+void vtil_stream_writer::finish()
+{
+	write_varint(0);
+	stream.flush();
+}
+
+void vtil_stream_writer::save(const routine* rtn, std::ostream& stream)
+{
+	std::map<vip_t, const basic_block*> blocks(rtn->explored_blocks.begin(), rtn->explored_blocks.end());
+
+	vtil_stream_writer writer(stream, rtn->arch_id);
+	if (rtn->entry_point)
+		writer.write_block(rtn->entry_point);
+	for (const auto& [vip, block] : blocks)
+	{
+		if (block != rtn->entry_point)
+			writer.write_block(block);
+	}
+	writer.finish();
+}
+
+vtil_stream_reader::vtil_stream_reader(std::istream& stream_)
+	: stream(stream_)
+{
+	uint32_t magic = 0;
+	stream.read((char*)&magic, 4);
+	if (!stream || magic != vtil_stream_magic || read_varint() != vtil_stream_version)
+	{
+		valid = false;
+		return;
+	}
+
+	rtn = new routine((architecture_identifier)read_varint());
+}
+
+uint64_t vtil_stream_reader::read_varint()
+{
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int byte = stream.get();
+		if (byte == EOF)
+		{
+			valid = false;
+			return 0;
+		}
+
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	valid = false;
+	return value;
+}
+
+int64_t vtil_stream_reader::read_signed()
+{
+	uint64_t value = read_varint();
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+operand vtil_stream_reader::read_operand()
+{
+	uint64_t ref = read_varint();
+	if (ref)
+	{
+		if (ref > operands.size())
+		{
+			valid = false;
+			return operand(0, 64);
+		}
+		return operands[ref - 1];
+	}
+
+	bool is_register = read_varint();
+	if (is_register)
+	{
+		register_desc reg;
+		reg.flags = read_varint();
+		reg.combined_id = read_varint();
+		reg.bit_count = (bitcnt_t)read_varint();
+		reg.bit_offset = (bitcnt_t)read_varint();
+		operands.emplace_back(reg);
+	}
+	else
+	{
+		uint64_t value = read_varint();
+		operands.emplace_back(value, (bitcnt_t)read_varint());
+	}
+	return operands.back();
+}
+
+basic_block* vtil_stream_reader::read_block()
+{
+	if (!valid || read_varint() != 1)
+		return nullptr;
+
+	vip_t entry_vip = read_varint();
+	basic_block* block = rtn->create_block(entry_vip).first;
+	block->sp_offset = read_signed();
+	block->sp_index = (uint32_t)read_varint();
+	block->last_temporary_index = (uint32_t)read_varint();
+
+	// counts and lengths come from the stream, so nothing is sized by them up front: successors are read one at
+	// a time until the stream runs out, and a name longer than any instruction's is refused before it is read
+	uint64_t next_count = read_varint();
+	std::vector<vip_t> next;
+	for (uint64_t i = 0; i < next_count && valid; i++)
+		next.push_back(read_varint());
+	links.emplace_back(block, std::move(next));
+
+	size_t count = read_varint();
+	vip_t last_vip = entry_vip;
+	for (size_t i = 0; i < count && valid; i++)
+	{
+		uint64_t ref = read_varint();
+		if (ref == 0)
+		{
+			static const size_t longest_name = std::max_element(std::begin(ins::list), std::end(ins::list), [](const instruction_desc& left, const instruction_desc& right) {
+				return left.name.size() < right.name.size();
+			})->name.size();
+
+			uint64_t length = read_varint();
+			if (!valid || length > longest_name)
+			{
+				valid = false;
+				return nullptr;
+			}
+
+			std::string name(length, '\0');
+			if (!stream.read(name.data(), name.size()))
+			{
+				valid = false;
+				return nullptr;
+			}
+
+			auto desc = std::find_if(std::begin(ins::list), std::end(ins::list), [&](const instruction_desc& desc) { return desc.name == name; });
+			if (desc == std::end(ins::list))
+			{
+				valid = false;
+				return nullptr;
+			}
+			names.push_back(&*desc);
+		}
+		else if (ref > names.size())
+		{
+			valid = false;
+			return nullptr;
+		}
+
+		instruction ins;
+		ins.base = ref ? names[ref - 1] : names.back();
+		ins.vip = last_vip + read_signed();
+		ins.sp_offset = read_signed();
+		ins.sp_index = (uint32_t)read_varint();
+		uint64_t flags = read_varint();
+		ins.sp_reset = flags & 1;
+		ins.explicit_volatile = flags & 2;
+		for (size_t j = 0; j < ins.base->operand_count(); j++)
+			ins.operands.push_back(read_operand());
+
+		if (ins.vip != invalid_vip)
+			last_vip = ins.vip;
+		block->push_back(std::move(ins));
+	}
+
+	return valid ? block : nullptr;
+}
+
+routine* vtil_stream_reader::finish()
+{
+	if (!valid)
+	{
+		delete rtn;
+		return nullptr;
+	}
+
+	for (auto& [block, next] : links)
+	{
+		for (vip_t vip : next)
+		{
+			auto it = rtn->explored_blocks.find(vip);
+			if (it == rtn->explored_blocks.end())
+			{
+				delete rtn;
+				return nullptr;
+			}
+
+			block->next.push_back(it->second);
+			it->second->prev.push_back(block);
+		}
+	}
+	return rtn;
+}
+
+routine* vtil_stream_reader::load(std::istream& stream)
+{
+	vtil_stream_reader reader(stream);
+	while (reader.read_block())
+		;
+	return reader.finish();
+}
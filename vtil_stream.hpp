@@ -0,0 +1,63 @@
+#pragma once
+#include "vm.hpp"
+
+#include <istream>
+#include <ostream>
+#include <map>
+
+// compact routine encoding: varints everywhere, operands and instruction names go into tables shared by the whole
+// stream (written inline on first use, referenced by index afterwards), blocks are written and read one at a time
+//
+//   header   "VTSC" version arch
+//   block    1 entry_vip sp_offset sp_index last_temporary_index next_count next_vip... instruction_count instruction...
+//   end      0
+//   instr    name_ref vip_delta sp_offset sp_index flags operand_ref...
+//   ref      0 followed by the definition, or index + 1
+constexpr uint32_t vtil_stream_magic = 0x43535456;	// "VTSC"
+constexpr uint64_t vtil_stream_version = 1;
+
+class vtil_stream_writer
+{
+public:
+	vtil_stream_writer(std::ostream& stream_, architecture_identifier arch);
+
+	void write_block(const basic_block* block);
+	void finish();
+
+	// everything at once, blocks in vip order
+	static void save(const routine* rtn, std::ostream& stream);
+
+private:
+	std::ostream& stream;
+	std::map<std::string, uint64_t> names;
+	std::map<std::tuple<bool, uint64_t, uint64_t, uint64_t, uint64_t>, uint64_t> operands;
+
+	void write_varint(uint64_t value);
+	void write_signed(int64_t value);
+	void write_operand(const operand& op);
+};
+
+class vtil_stream_reader
+{
+public:
+	vtil_stream_reader(std::istream& stream_);
+
+	// nullptr at the end of the stream, blocks are linked once finish() has seen them all
+	basic_block* read_block();
+	routine* finish();
+
+	static routine* load(std::istream& stream);
+
+	bool valid = true;
+
+private:
+	std::istream& stream;
+	routine* rtn = nullptr;
+	std::vector<const instruction_desc*> names;
+	std::vector<operand> operands;
+	std::vector<std::pair<basic_block*, std::vector<vip_t>>> links;
+
+	uint64_t read_varint();
+	int64_t read_signed();
+	operand read_operand();
+};